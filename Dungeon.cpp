@@ -9,10 +9,22 @@
 #include <vector>
 #include <limits>
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 #ifdef __APPLE__
   #include <libkern/OSByteOrder.h>
@@ -25,22 +37,171 @@
 #endif
 
 // ------ NCURSES includes ------
+// Building with -DRLG_HEADLESS leaves ncurses out entirely; the game can then
+// only be driven by one of the scripted/random/greedy PC controllers.
+#ifndef RLG_HEADLESS
 #include <curses.h>
+#endif
 static const char *DUNGEON_DIR   = "/.rlg327/";
 static const char *DUNGEON_FILE  = "dungeon";
 static const char *FILE_MARKER   = "RLG327-S2025";
 static const int   MARKER_LEN    = 12;
 static const int   FILE_VERSION  = 0;
-static const int   WIDTH         = 80;
-static const int   HEIGHT        = 21;
-static const int   MAX_ROOMS     = 10;
+static const int   DEFAULT_WIDTH  = 80;
+static const int   DEFAULT_HEIGHT = 21;
+static const int   MIN_WIDTH      = 20;
+static const int   MIN_HEIGHT     = 10;
+static const int   MAX_DIMENSION  = 4096;
 static const int   DEFAULT_NUMMON = 10;
 
 // "Fog of War" radius
 static const int   PC_LIGHT_RADIUS = 3;
 
+// Most turns a far monster (--lod) takes in one coarse update
+static const int   LOD_MAX_STEPS = 8;
+
+// xoshiro256** seeded through splitmix64. Every random draw in the game goes
+// through the Dungeon's instance, so one --seed reproduces a whole session.
+class Rng {
+public:
+    explicit Rng(uint64_t seed = 0) { reseed(seed); }
+
+    void reseed(uint64_t seed) {
+        for(int i=0; i<4; i++){
+            seed += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            s[i] = z ^ (z >> 31);
+        }
+    }
+
+    uint64_t next() {
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    // Uniform in [0, n) for n > 0 (multiply-shift, no division)
+    int below(int n) {
+        return (int)(((next() >> 32) * (uint64_t)n) >> 32);
+    }
+
+private:
+    uint64_t s[4];
+
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+};
+
+// Seed for the n-th floor after the first. Floors don't draw from the play
+// stream, so a floor can be built ahead of time and still come out the same.
+static uint64_t floorSeed(uint64_t seed, long n) {
+    uint64_t z = seed + (uint64_t)(n + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Heap-backed 2D array sized at runtime, stored flat with a one-cell pad
+// around the map. grid[y][x] indexes it like the fixed arrays it replaced;
+// inner loops use index() and neighbour offsets instead, and because the pad
+// is always there (holding a "blocked" value) they need no bounds checks.
+template <class T>
+class Grid {
+public:
+    Grid() : w(0), h(0), stride_(0) {}
+
+    void assign(int width, int height, T fill, T pad) {
+        w = width;
+        h = height;
+        stride_ = width + 2;
+        cells.assign((size_t)stride_ * (height + 2), pad);
+        for(int y=0; y<height; y++){
+            std::fill_n(&cells[index(0, y)], width, fill);
+        }
+    }
+    void assign(int width, int height, T fill) { assign(width, height, fill, fill); }
+
+    // Fills the map, leaves the pad alone.
+    void fill(T v) {
+        for(int y=0; y<h; y++){
+            std::fill_n(&cells[index(0, y)], w, v);
+        }
+    }
+
+    int index(int x, int y) const { return (y + 1)*stride_ + x + 1; }
+    int stride() const { return stride_; }
+    int cellCount() const { return (int)cells.size(); }
+
+    T *operator[](int y) { return &cells[(size_t)(y + 1)*stride_ + 1]; }
+    const T *operator[](int y) const { return &cells[(size_t)(y + 1)*stride_ + 1]; }
+    T &at(int idx) { return cells[idx]; }
+    const T &at(int idx) const { return cells[idx]; }
+    T *data() { return cells.data(); }
+    const T *data() const { return cells.data(); }
+    int width() const { return w; }
+    int height() const { return h; }
+
+private:
+    int w, h, stride_;
+    std::vector<T> cells;
+};
+
+// One bit per cell in the same padded layout as Grid, so a Grid index can be
+// used directly. The pad bits are always clear.
+class CellMask {
+public:
+    CellMask() : stride_(0) {}
+
+    void assign(int width, int height) {
+        stride_ = width + 2;
+        words.assign(((size_t)stride_ * (height + 2) + 63) / 64, 0);
+    }
+    void clear() { std::fill(words.begin(), words.end(), 0); }
+
+    bool test(int idx) const { return (words[idx >> 6] >> (idx & 63)) & 1; }
+    void set(int idx)   { words[idx >> 6] |= (uint64_t)1 << (idx & 63); }
+    void reset(int idx) { words[idx >> 6] &= ~((uint64_t)1 << (idx & 63)); }
+    void set(int idx, bool v) { if(v) set(idx); else reset(idx); }
+
+    int index(int x, int y) const { return (y + 1)*stride_ + x + 1; }
+
+private:
+    int stride_;
+    std::vector<uint64_t> words;
+};
+
+// Distances are stored as uint16. Anything past DIST_SAT is clamped to it, so
+// "very far" still reads as reachable and DIST_INF stays "no path".
+static const uint16_t DIST_INF = 65535;
+static const uint16_t DIST_SAT = 65534;
+
+// Next-hop directions, row by row from the top-left neighbour (the order
+// monsters have always scanned in, so ties resolve the same way). HOP_STAY
+// means no neighbour has a path.
+static const uint8_t HOP_STAY = 8;
+static const int     HOP_DX[9] = { -1, 0, 1, -1, 1, -1, 0, 1, 0 };
+static const int     HOP_DY[9] = { -1, -1, -1, 0, 0, 1, 1, 1, 0 };
+
 // Forward declarations
 class Dungeon;
+class LevelPrefetch;
+class FloorStack;
+
+// Characters are named by handle rather than pointer: 0 is the PC and i+1 is
+// Dungeon::npcs[i], so handles survive the monster array growing.
+typedef int32_t CharHandle;
+static const CharHandle NO_CHAR   = -1;
+static const CharHandle PC_HANDLE = 0;
+
 class Character {
 public:
     enum CharType {
@@ -56,10 +217,14 @@ public:
     int        hp;
     uint8_t    btype;      // Monster behavior bit flags (for NPCs only)
     char       symbol;
+    CharHandle handle;
+    // Links in the list of characters on this cell (Dungeon::occupants)
+    CharHandle prevHere, nextHere;
 
     Character()
         : type(NPC_TYPE), alive(true), x(0), y(0), speed(10), turn(0),
-          hp(10), btype(0), symbol('?')
+          hp(10), btype(0), symbol('?'), handle(NO_CHAR), prevHere(NO_CHAR),
+          nextHere(NO_CHAR)
     {}
 
     virtual ~Character() {}
@@ -68,18 +233,151 @@ public:
     virtual void doTurn(Dungeon &d) = 0;
 };
 
+// Cells within a radius r of the origin (dx*dx + dy*dy <= r*r), worked out
+// at compile time. Clearing the view, updating the PC's memory and drawing
+// the lit cells all walk this list instead of the screen.
+struct CellOffset {
+    int8_t dx, dy;
+};
+
+constexpr int diskCount(int r) {
+    int n = 0;
+    for(int dy=-r; dy<=r; dy++){
+        for(int dx=-r; dx<=r; dx++){
+            if(dx*dx + dy*dy <= r*r) n++;
+        }
+    }
+    return n;
+}
+
+template <int R>
+constexpr std::array<CellOffset, diskCount(R)> diskOffsets() {
+    static_assert(R >= 0 && R < 128, "offsets are stored as int8_t");
+    std::array<CellOffset, diskCount(R)> a{};
+    int k = 0;
+    for(int dy=-R; dy<=R; dy++){
+        for(int dx=-R; dx<=R; dx++){
+            if(dx*dx + dy*dy <= R*R) a[k++] = CellOffset{ (int8_t)dx, (int8_t)dy };
+        }
+    }
+    return a;
+}
+
+static constexpr auto LIGHT_DISK = diskOffsets<PC_LIGHT_RADIUS>();
+
+// What the PC can see this turn: recursive shadowcasting over the eight
+// octants out to PC_LIGHT_RADIUS, where anything with hardness > 0 blocks
+// the view (but is itself seen). The result is a bitmap in the grids'
+// padded layout; only cells in LIGHT_DISK around the origin are ever set.
+class FieldOfView {
+public:
+    FieldOfView() : ox(-1), oy(-1) {}
+
+    void reset(int w, int h) {
+        mask.assign(w, h);
+        ox = oy = -1;
+    }
+
+    void compute(const Grid<uint8_t> &hard, int x, int y) {
+        clear(hard);
+        ox = x;
+        oy = y;
+        mark(hard, x, y);
+        static const int MULT[4][8] = {
+            { 1,  0,  0, -1, -1,  0,  0,  1 },
+            { 0,  1, -1,  0,  0, -1,  1,  0 },
+            { 0,  1,  1,  0,  0, -1, -1,  0 },
+            { 1,  0,  0,  1, -1,  0,  0, -1 },
+        };
+        for(int oct=0; oct<8; oct++){
+            castLight(hard, 1, 1.0, 0.0, MULT[0][oct], MULT[1][oct], MULT[2][oct], MULT[3][oct]);
+        }
+    }
+
+    bool visible(const Grid<uint8_t> &hard, int x, int y) const {
+        return x >= 0 && y >= 0 && x < hard.width() && y < hard.height() &&
+               mask.test(hard.index(x, y));
+    }
+
+    // Where the view was last computed from (-1 before the first time)
+    int originX() const { return ox; }
+    int originY() const { return oy; }
+
+private:
+    CellMask mask;
+    int      ox, oy;
+
+    void clear(const Grid<uint8_t> &hard) {
+        if(ox < 0) return;
+        for(const CellOffset &o : LIGHT_DISK) {
+            int x = ox + o.dx, y = oy + o.dy;
+            if(x >= 0 && y >= 0 && x < hard.width() && y < hard.height()) {
+                mask.reset(hard.index(x, y));
+            }
+        }
+    }
+
+    void mark(const Grid<uint8_t> &hard, int x, int y) {
+        mask.set(hard.index(x, y));
+    }
+
+    static bool opaque(const Grid<uint8_t> &hard, int x, int y) {
+        return x < 0 || y < 0 || x >= hard.width() || y >= hard.height() || hard[y][x] != 0;
+    }
+
+    // Rows `row` and beyond of one octant, between slopes start and end.
+    void castLight(const Grid<uint8_t> &hard, int row, double start, double end,
+                   int xx, int xy, int yx, int yy) {
+        const int r = PC_LIGHT_RADIUS;
+        if(start < end) return;
+        double newStart = 0.0;
+        for(int j=row; j<=r; j++){
+            bool blocked = false;
+            int dy = -j;
+            for(int dx=-j; dx<=0; dx++){
+                int x = ox + dx*xx + dy*xy;
+                int y = oy + dx*yx + dy*yy;
+                double lSlope = (dx - 0.5) / (dy + 0.5);
+                double rSlope = (dx + 0.5) / (dy - 0.5);
+                if(start < rSlope) continue;
+                if(end > lSlope) break;
+                bool wall = opaque(hard, x, y);
+                if(dx*dx + dy*dy <= r*r && x >= 0 && y >= 0 && x < hard.width() &&
+                   y < hard.height()) {
+                    mark(hard, x, y);
+                }
+                if(blocked) {
+                    if(wall) {
+                        newStart = rSlope;
+                        continue;
+                    }
+                    blocked = false;
+                    start = newStart;
+                } else if(wall && j < r) {
+                    blocked = true;
+                    castLight(hard, j + 1, start, lSlope, xx, xy, yx, yy);
+                    newStart = rSlope;
+                }
+            }
+            if(blocked) break;
+        }
+    }
+};
+
 class PC : public Character {
 public:
     // The PC will maintain its own memory of the terrain
-    char remembered_map[HEIGHT][WIDTH];
+    Grid<char> remembered_map;
     // Whether to show no fog
     bool noFog;
     // Are we currently in teleport mode?
     bool teleporting;
     // Teleport-cursor position
     int teleportXCoordinates, teleportYCoordinates;
+    // Cells lit this turn; see updateRemembered()
+    FieldOfView fov;
 
-    PC() {
+    PC(int mapWidth, int mapHeight) {
         type = PC_TYPE;
         alive = true;
         speed = 10;
@@ -88,31 +386,29 @@ public:
         btype = 0; // PC has no monster bitflags
         noFog = false;
         teleporting = false;
+        teleportXCoordinates = teleportYCoordinates = 0;
         // Initialize remembered_map to spaces
-        for(int r = 0; r < HEIGHT; r++){
-            for(int c = 0; c < WIDTH; c++){
-                remembered_map[r][c] = ' ';
-            }
-        }
+        remembered_map.assign(mapWidth, mapHeight, ' ');
+        fov.reset(mapWidth, mapHeight);
     }
 
     virtual void doTurn(Dungeon &d) override;
 
-    // Update the PC's remembered map based on visibility
+    // Recompute the field of view from where the PC stands and remember
+    // everything in it
     void updateRemembered(Dungeon &d);
 
-    // Check if cell (x2,y2) is visible to PC (within radius)
-    bool isVisible(int x2, int y2) const {
-        int dx = x2 - x;
-        int dy = y2 - y;
-        // Euclidean distance <= PC_LIGHT_RADIUS
-        return (dx*dx + dy*dy) <= (PC_LIGHT_RADIUS*PC_LIGHT_RADIUS);
-    }
+    // Was cell (x2,y2) in view when updateRemembered() last ran?
+    bool isVisible(const Dungeon &d, int x2, int y2) const;
 };
 
 class NPC : public Character {
 public:
+    // Where this monster last saw the PC; -1 if it has no idea
+    int lastPcX, lastPcY;
+
     NPC(uint8_t behavior_flags, int start_x, int start_y, int spd, int health)
+        : lastPcX(-1), lastPcY(-1)
     {
         type   = NPC_TYPE;
         alive  = true;
@@ -137,7 +433,7 @@ struct Room {
 
 struct Event {
     int        time;
-    Character *c;
+    CharHandle who;
 };
 
 class EventQueue {
@@ -197,8 +493,130 @@ private:
     }
 };
 
+// A turn lands 1000/speed after the last one, and speed is at least 1, so
+// the game loop never schedules more than 1000 ahead of the current time.
+static const int MAX_TURN_DELAY = 1000;
+
+// Timing wheel for the game loop, in place of the EventQueue heap. Every
+// pending turn is within MAX_TURN_DELAY of the current time, so a ring of
+// WHEEL_SIZE buckets holds each time in its own bucket. pop finds the next
+// non-empty bucket through a bitmap, 64 buckets per word. Each character has
+// at most one pending turn, kept by handle in a list threaded through its
+// slot, so scheduling, rescheduling and cancelling are O(1) and a dead
+// character's turn leaves the wheel as soon as it dies. Turns at the same
+// time come out in the order they were scheduled.
+class TimingWheel {
+public:
+    static const int WHEEL_SIZE = 1024;
+    static_assert(WHEEL_SIZE > MAX_TURN_DELAY, "a bucket must hold only one time");
+
+    TimingWheel() { clear(); }
+
+    bool   empty() const { return count == 0; }
+    size_t size() const  { return count; }
+    int    now() const   { return now_; }
+
+    // Drops every pending turn and sets the clock to start.
+    void clear(int start = 0) {
+        for(Slot &sl : slots) sl.queued = false;
+        std::fill(head, head + WHEEL_SIZE, NO_CHAR);
+        std::fill(tail, tail + WHEEL_SIZE, NO_CHAR);
+        occupied.fill(0);
+        now_ = start;
+        count = 0;
+    }
+
+    bool scheduled(CharHandle who) const {
+        return who >= 0 && who < (CharHandle)slots.size() && slots[who].queued;
+    }
+
+    // who's next turn is at time, replacing any it had. time must be in
+    // [now(), now() + MAX_TURN_DELAY].
+    void schedule(CharHandle who, int time) {
+        if(who >= (CharHandle)slots.size()) slots.resize(who + 1);
+        cancel(who);
+        int b = time & (WHEEL_SIZE - 1);
+        Slot &sl = slots[who];
+        sl.time = time;
+        sl.queued = true;
+        sl.prev = tail[b];
+        sl.next = NO_CHAR;
+        if(tail[b] != NO_CHAR) slots[tail[b]].next = who;
+        else                   head[b] = who;
+        tail[b] = who;
+        occupied[b >> 6] |= (uint64_t)1 << (b & 63);
+        count++;
+    }
+
+    void push(const Event &e) { schedule(e.who, e.time); }
+
+    void cancel(CharHandle who) {
+        if(!scheduled(who)) return;
+        Slot &sl = slots[who];
+        int b = sl.time & (WHEEL_SIZE - 1);
+        if(sl.prev != NO_CHAR) slots[sl.prev].next = sl.next;
+        else                   head[b] = sl.next;
+        if(sl.next != NO_CHAR) slots[sl.next].prev = sl.prev;
+        else                   tail[b] = sl.prev;
+        if(head[b] == NO_CHAR) occupied[b >> 6] &= ~((uint64_t)1 << (b & 63));
+        sl.queued = false;
+        count--;
+    }
+
+    Event pop() {
+        int b = nextBucket();
+        CharHandle who = head[b];
+        now_ = slots[who].time;
+        cancel(who);
+        return Event{ now_, who };
+    }
+
+    // Calls f(who, time) for every pending turn, in the order pop would
+    // give them.
+    template <typename F>
+    void forEach(F f) const {
+        for(int i=0; i<WHEEL_SIZE; i++){
+            for(CharHandle h = head[(now_ + i) & (WHEEL_SIZE - 1)]; h != NO_CHAR; h = slots[h].next) {
+                f(h, slots[h].time);
+            }
+        }
+    }
+
+    size_t memoryBytes() const { return slots.capacity() * sizeof(Slot) + sizeof(*this); }
+
+private:
+    static const int WORDS = WHEEL_SIZE / 64;
+
+    struct Slot {
+        int        time = 0;
+        CharHandle prev = NO_CHAR, next = NO_CHAR;
+        bool       queued = false;
+    };
+
+    std::vector<Slot>           slots;   // by handle
+    CharHandle                  head[WHEEL_SIZE], tail[WHEEL_SIZE];
+    std::array<uint64_t, WORDS> occupied;
+    int                         now_;
+    size_t                      count;
+
+    // First non-empty bucket at or after now, wrapping round the ring.
+    int nextBucket() const {
+        int start = now_ & (WHEEL_SIZE - 1);
+        int w = start >> 6;
+        uint64_t bits = occupied[w] & (~(uint64_t)0 << (start & 63));
+        for(int i=0; i<=WORDS; i++){
+            if(bits) {
+                return (w << 6) | __builtin_ctzll(bits);
+            }
+            w = (w + 1) % WORDS;
+            bits = occupied[w];
+        }
+        return start; // not reached while count > 0
+    }
+};
+
 struct Node {
-    int x, y;
+    int idx;    // Grid::index() of the cell
     int dist;
 };
 
@@ -206,14 +624,14 @@ class NodeHeap {
 public:
     std::vector<Node> array;
 
-    NodeHeap() {
-        array.reserve(WIDTH * HEIGHT);
-    }
+    NodeHeap() {}
     void insert(const Node &n) {
         array.push_back(n);
         heapifyUp(array.size() - 1);
     }
     bool empty() const { return array.empty(); }
+    const Node &top() const { return array[0]; }
+    void clear() { array.clear(); }
 
     Node pop() {
         Node top = array[0];
@@ -258,260 +676,1182 @@ private:
     }
 };
 
-class Dungeon {
+// Plain FIFO. Exact for unit edge costs when fed from a single source.
+class NodeQueue {
 public:
-    int hardness[HEIGHT][WIDTH];
-    char base_map[HEIGHT][WIDTH];
-    char dungeon[HEIGHT][WIDTH];
-    int disTunneling[HEIGHT][WIDTH];
-    int disNonTunneling[HEIGHT][WIDTH];
+    std::vector<Node> array;
+    size_t head;
 
-    
-    int pc_x, pc_y;
+    NodeQueue() : head(0) {}
+    void insert(const Node &n) { array.push_back(n); }
+    bool empty() const { return head == array.size(); }
+    void clear() { array.clear(); head = 0; }
 
-    // Rooms
-    Room rooms[MAX_ROOMS];
-    int  room_count;
+    Node pop() {
+        return array[head++];
+    }
+};
 
-    // Stair data
-    int upCount, downCount;
-    int up_xCoord, up_yCoord;
-    int down_xCoord, down_yCoord;
-    int global_num_monsters;
-    std::vector<Character*> characters;
+// Tunneling costs 1 + hardness/85, so no edge costs more than this.
+static const int MAX_EDGE_COST = 1 + 254/85;
 
-    // PC alive or not
-    bool pc_is_alive;
-    bool changedFloor;
+// Dial's bucket queue. Dijkstra with edge costs in [1, MAX_EDGE_COST] only
+// ever has keys in [cur, cur+MAX_EDGE_COST] live, so a ring of that many
+// buckets replaces the heap. Keys further out (repair seeds) wait in a small
+// heap until the ring reaches them.
+class BucketQueue {
+public:
+    static const int NUM_BUCKETS = MAX_EDGE_COST + 1;
 
-    Dungeon() {
-        pc_is_alive = true;
-        global_num_monsters = DEFAULT_NUMMON;
-        upCount = downCount = 0;
-        up_xCoord = up_yCoord = 0;
-        down_xCoord = down_yCoord = 0;
-        room_count = 0;
-        pc_x = pc_y = 0;
-        changedFloor = false;
+    BucketQueue() : cur(0), count(0) {}
 
-        // Clear arrays
-        for(int r=0; r<HEIGHT; r++){
-            for(int c=0; c<WIDTH; c++){
-                hardness[r][c] = 0;
-                base_map[r][c] = ' ';
-                dungeon[r][c]  = ' ';
-                disTunneling[r][c] = INT32_MAX;
-                disNonTunneling[r][c] = INT32_MAX;
+    void insert(const Node &n) {
+        if(count == 0 && far.empty()) {
+            cur = n.dist;
+        } else if(n.dist < cur) {
+            // Only happens while seeding, before the first pop.
+            for(int i=0; i<NUM_BUCKETS; i++){
+                for(const Node &b : buckets[i]) far.insert(b);
+                buckets[i].clear();
             }
+            count = 0;
+            cur = n.dist;
+        }
+        if(n.dist < cur + NUM_BUCKETS) {
+            buckets[n.dist % NUM_BUCKETS].push_back(n);
+            count++;
+        } else {
+            far.insert(n);
         }
     }
 
-    ~Dungeon() {
-        for(auto c : characters) {
-            delete c;
+    bool empty() const { return count == 0 && far.empty(); }
+
+    void clear() {
+        for(int i=0; i<NUM_BUCKETS; i++) buckets[i].clear();
+        far.clear();
+        count = 0;
+        cur = 0;
+    }
+
+    Node pop() {
+        if(count == 0) {
+            cur = far.top().dist;
+            pullFar();
+        }
+        while(buckets[cur % NUM_BUCKETS].empty()) {
+            cur++;
+            pullFar();
         }
-        characters.clear();
+        std::vector<Node> &b = buckets[cur % NUM_BUCKETS];
+        Node n = b.back();
+        b.pop_back();
+        count--;
+        return n;
     }
 
-    bool inBounds(int x, int y) const {
-        return (x >= 0 && x < WIDTH && y >= 0 && y < HEIGHT);
+private:
+    std::vector<Node> buckets[NUM_BUCKETS];
+    NodeHeap          far;
+    int               cur;
+    int               count;
+
+    void pullFar() {
+        while(!far.empty() && far.top().dist < cur + NUM_BUCKETS) {
+            Node n = far.pop();
+            buckets[n.dist % NUM_BUCKETS].push_back(n);
+            count++;
+        }
     }
-    bool isImmutableRock(int x, int y) const {
-        return hardness[y][x] == 255;
+};
+
+// Single-source distance map over the hardness grid that is kept up to date
+// incrementally. Callers report where the source is and which cells were dug;
+// update() then does the least work that makes dist[] exact again:
+//  - nothing reported      -> nothing to do
+//  - a cell got cheaper     -> relax outward from that cell only
+//  - anything else          -> full Dijkstra
+// A source move is always a full pass. Even a one-cell step shifts about
+// half the map by one, and repairing that many cells (--bench paths, second
+// table) costs more than recomputing them.
+// All indices are padded Grid indices; the pad is hardness 255 / not open, so
+// it is never entered and neighbours need no bounds checks.
+class DistanceMap {
+public:
+    enum Kind {
+        NON_TUNNELING,
+        TUNNELING
+    };
+
+    // hopGrid is optional; if given it is kept in step with distGrid.
+    DistanceMap(Kind k, const Grid<uint8_t> *hardnessGrid, const CellMask *openCells,
+                Grid<uint16_t> *distGrid, Grid<uint8_t> *hopGrid = nullptr)
+        : kind(k), hardness(hardnessGrid), open(openCells), dist(distGrid), hops(hopGrid),
+          srcIdx(-1), pendingIdx(-1), needFull(true), saturated(false), logging(false),
+          logLimit(0)
+    {
+        int st = dist->stride();
+        const int offs[8] = { -1, 1, -st, st, -st-1, st-1, -st+1, st+1 };
+        std::copy(offs, offs + 8, nbr);
     }
-    bool isFloor(int x, int y) const {
-        char c = base_map[y][x];
-        return (c == '.' || c == '#' || c == '<' || c == '>');
+
+    // Cost of stepping onto cell idx, or -1 if this kind of mover can't.
+    int cost(int idx) const {
+        if(kind == NON_TUNNELING) {
+            return open->test(idx) ? 1 : -1;
+        }
+        return tunnelCost(hardness->at(idx));
     }
-    bool pcCanWalkOn(char cell) const {
-        return (cell == '.' || cell == '#' || cell == '<' || cell == '>');
+
+    void setSource(int x, int y) {
+        pendingIdx = dist->index(x, y);
     }
 
-    void rebuildDisplay() {
-        memcpy(dungeon, base_map, sizeof(dungeon));
-        for (auto c : characters) {
-            if(c->alive) {
-                dungeon[c->y][c->x] = c->symbol;
-            }
+    // Hardness at (x,y) was oldHardness before the caller changed it.
+    void cellChanged(int x, int y, int oldHardness) {
+        if(needFull) return;
+        int idx = dist->index(x, y);
+        int oldCost = costFor(oldHardness);
+        int newCost = cost(idx);
+        if(oldCost == newCost) return;
+        if(newCost < 0 || (oldCost >= 0 && newCost > oldCost)) {
+            // Only digging happens during play; anything that makes a cell
+            // dearer is rare enough to just recompute.
+            needFull = true;
+            return;
         }
+        cheaper.push_back(idx);
     }
 
-    // Dijkstra for tunnelers
-    void djikstraForTunnel(int x, int y) {
-        for(int i=0; i<HEIGHT; i++){
-            for(int j=0; j<WIDTH; j++){
-                disTunneling[i][j] = INT32_MAX;
-            }
+    void invalidate() {
+        needFull = true;
+        cheaper.clear();
+    }
+
+    // Returns true if dist[] changed.
+    bool update() {
+        // Clamped distances aren't exact, so repairs can't trust them.
+        if(needFull || (saturated && (!cheaper.empty() || pendingIdx != srcIdx))) {
+            recomputeAt(pendingIdx);
+            rebuildHops();
+            return true;
+        }
+        // Repairs log every cell they rewrite so the hops around it can be
+        // patched afterwards. Patching costs ~8x a vectorised rebuild per
+        // cell, so past a limit logging stops and the whole hop map is
+        // rebuilt instead.
+        logging = (hops != nullptr);
+        logLimit = dist->cellCount() / 32;
+        changedCells.clear();
+        bool changed = false;
+        for(int idx : cheaper) {
+            changed |= relaxCheaperCell(idx);
+        }
+        cheaper.clear();
+        if(pendingIdx != srcIdx) {
+            logging = false;
+            recomputeAt(pendingIdx);
+            changed = true;
+        }
+        if(logging) {
+            patchHops();
+        } else if(changed) {
+            rebuildHops();
+        }
+        logging = false;
+        changedCells.clear();
+        return changed;
+    }
+
+    void recompute(int x, int y) {
+        recomputeAt(dist->index(x, y));
+        rebuildHops();
+    }
+
+    // Whole hop map from dist[], one row at a time.
+    void rebuildHops() {
+        if(!hops) return;
+        int st = dist->stride();
+        const uint16_t *dd = dist->data();
+        uint8_t *hp = hops->data();
+        for(int y=0; y<dist->height(); y++){
+            int base = dist->index(0, y);
+            hopRow(dd + base - st, dd + base, dd + base + st, hp + base, dist->width());
         }
-        disTunneling[y][x] = 0;
-        NodeHeap h;
-        h.insert(Node{x, y, 0});
+    }
 
-        int dirs[8][2] = {
-            {-1,0},{1,0},{0,-1},{0,1},
-            {-1,-1},{-1,1},{1,-1},{1,1}
-        };
+    // Trades source and repair state with a map of the same kind and size
+    // whose grids are being swapped in at the same time.
+    void swapState(DistanceMap &o) {
+        std::swap(srcIdx, o.srcIdx);
+        std::swap(pendingIdx, o.pendingIdx);
+        std::swap(needFull, o.needFull);
+        std::swap(saturated, o.saturated);
+        cheaper.swap(o.cheaper);
+    }
+
+    // Full pass with a caller-chosen queue; used by the pathfinding benchmark.
+    template <class Queue>
+    void recomputeWith(Queue &q, int x, int y) {
+        startFull(dist->index(x, y));
+        q.clear();
+        q.insert(Node{srcIdx, 0});
+        propagate(q);
+    }
+
+private:
+    Kind                  kind;
+    const Grid<uint8_t>  *hardness;
+    const CellMask       *open;
+    Grid<uint16_t>       *dist;
+    Grid<uint8_t>        *hops;
+    int                   nbr[8];
+    int                   srcIdx;
+    int                   pendingIdx;
+    bool                  needFull;
+    bool                  saturated;
+    bool                  logging;
+    size_t                logLimit;
+    std::vector<int>      changedCells;
+    std::vector<int>      cheaper;
+    NodeQueue             fifo;
+    BucketQueue           buckets;
+
+    static int tunnelCost(int hh) {
+        return hh == 255 ? -1 : 1 + hh/85;
+    }
+
+    int costFor(int hh) const {
+        if(kind == NON_TUNNELING) return hh == 0 ? 1 : -1;
+        return tunnelCost(hh);
+    }
+
+    void startFull(int idx) {
+        dist->fill(DIST_INF);
+        srcIdx = pendingIdx = idx;
+        needFull = false;
+        saturated = false;
+        cheaper.clear();
+        dist->at(idx) = 0;
+    }
+
+    void recomputeAt(int idx) {
+        startFull(idx);
+        // The non-tunneling map is unit cost, so a BFS is already in order.
+        seedOne(idx, 0);
+    }
+
+    // Standard Dijkstra relaxation from whatever is already in the queue.
+    template <class Queue>
+    void propagate(Queue &h) {
+        if(kind == TUNNELING) propagateKind<true>(h);
+        else                  propagateKind<false>(h);
+    }
 
+    template <bool Tunnel, class Queue>
+    void propagateKind(Queue &h) {
+        uint16_t *dd = dist->data();
+        const uint8_t *hh = hardness->data();
         while(!h.empty()) {
             Node u = h.pop();
-            if(u.dist > disTunneling[u.y][u.x]) continue;
-
+            if(u.dist > dd[u.idx]) continue;
             for(int i=0; i<8; i++){
-                int nx = u.x + dirs[i][0];
-                int ny = u.y + dirs[i][1];
-                if(!inBounds(nx, ny)) continue;
-                if(hardness[ny][nx] != 255) {
-                    int cost = 1;
-                    if(hardness[ny][nx] > 0 && hardness[ny][nx] < 255){
-                        cost += hardness[ny][nx]/85;
-                    }
-                    int alt = u.dist + cost;
-                    if(alt < disTunneling[ny][nx]) {
-                        disTunneling[ny][nx] = alt;
-                        h.insert(Node{nx, ny, alt});
-                    }
+                int v = u.idx + nbr[i];
+                int c = Tunnel ? tunnelCost(hh[v]) : (open->test(v) ? 1 : -1);
+                if(c < 0) continue;
+                int alt = u.dist + c;
+                if(alt > DIST_SAT) {
+                    alt = DIST_SAT;
+                    saturated = true;
+                }
+                if(alt < dd[v]) {
+                    dd[v] = (uint16_t)alt;
+                    if(logging) logChange(v);
+                    h.insert(Node{v, alt});
                 }
             }
         }
     }
 
-    // Dijkstra for non-tunnelers
-    void djikstraForNonTunnel(int x, int y) {
-        for(int r=0; r<HEIGHT; r++){
-            for(int c=0; c<WIDTH; c++){
-                disNonTunneling[r][c] = INT32_MAX;
-            }
+    // Best distance into idx through its neighbours.
+    int bestViaNeighbours(int idx) const {
+        int c = cost(idx);
+        if(c < 0) return DIST_INF;
+        const uint16_t *dd = dist->data();
+        int best = DIST_INF;
+        for(int i=0; i<8; i++){
+            int n = idx + nbr[i];
+            if(dd[n] == DIST_INF) continue;
+            if(dd[n] + c < best) best = dd[n] + c;
         }
-        disNonTunneling[y][x] = 0;
+        return best;
+    }
 
-        NodeHeap h;
-        h.insert(Node{x, y, 0});
+    bool relaxCheaperCell(int idx) {
+        if(idx == srcIdx) return false;
+        int best = bestViaNeighbours(idx);
+        if(best >= dist->at(idx)) return false;
+        dist->at(idx) = (uint16_t)best;
+        if(logging) logChange(idx);
+        seedOne(idx, best);
+        return true;
+    }
 
-        int dirs[8][2] = {
-            {-1,0},{1,0},{0,-1},{0,1},
-            {-1,-1},{-1,1},{1,-1},{1,1}
-        };
+    // Propagate a single improved cell. A lone seed on the unit-cost map is
+    // a BFS; everything else goes through the bucket queue.
+    void seedOne(int idx, int d) {
+        if(kind == NON_TUNNELING) {
+            fifo.clear();
+            fifo.insert(Node{idx, d});
+            propagate(fifo);
+        } else {
+            buckets.clear();
+            buckets.insert(Node{idx, d});
+            propagate(buckets);
+        }
+    }
 
-        while(!h.empty()) {
-            Node u = h.pop();
-            if(u.dist > disNonTunneling[u.y][u.x]) continue;
+    // Hops for one row from the distances in the rows above, on and below it.
+    // Selects instead of branches and no aliasing, so it vectorises across x
+    // (GCC's -O2 cost model won't on its own; clang does at -O2).
+#if defined(__GNUC__) && !defined(__clang__)
+    __attribute__((optimize("tree-loop-vectorize", "vect-cost-model=dynamic")))
+#endif
+    static void hopRow(const uint16_t *__restrict up, const uint16_t *__restrict mid,
+                       const uint16_t *__restrict dn, uint8_t *__restrict out, int w) {
+        for(int x=0; x<w; x++){
+            // Same width as the distances so every lane lines up
+            uint16_t best = DIST_INF;
+            uint16_t dir  = HOP_STAY;
+            uint16_t v;
+            v = up[x-1];  dir = v < best ? 0 : dir; best = v < best ? v : best;
+            v = up[x];    dir = v < best ? 1 : dir; best = v < best ? v : best;
+            v = up[x+1];  dir = v < best ? 2 : dir; best = v < best ? v : best;
+            v = mid[x-1]; dir = v < best ? 3 : dir; best = v < best ? v : best;
+            v = mid[x+1]; dir = v < best ? 4 : dir; best = v < best ? v : best;
+            v = dn[x-1];  dir = v < best ? 5 : dir; best = v < best ? v : best;
+            v = dn[x];    dir = v < best ? 6 : dir; best = v < best ? v : best;
+            v = dn[x+1];  dir = v < best ? 7 : dir;
+            out[x] = (uint8_t)dir;
+        }
+    }
+
+    void logChange(int idx) {
+        changedCells.push_back(idx);
+        if(changedCells.size() > logLimit) logging = false;
+    }
 
+    // A cell's hop only depends on its neighbours' distances, so redo the
+    // hops around each rewritten cell (pad cells have no hop).
+    void patchHops() {
+        int st = dist->stride();
+        int w = dist->width(), h = dist->height();
+        const uint16_t *dd = dist->data();
+        uint8_t *hp = hops->data();
+        for(int v : changedCells) {
+            int vx = v % st - 1, vy = v / st - 1;
             for(int i=0; i<8; i++){
-                int nx = u.x + dirs[i][0];
-                int ny = u.y + dirs[i][1];
-                if(!inBounds(nx, ny)) continue;
-                // non-tunnelers only pass if hardness[ny][nx] == 0
-                if(hardness[ny][nx] == 0) {
-                    int alt = u.dist + 1;
-                    if(alt < disNonTunneling[ny][nx]) {
-                        disNonTunneling[ny][nx] = alt;
-                        h.insert(Node{nx, ny, alt});
+                int nx = vx + HOP_DX[i], ny = vy + HOP_DY[i];
+                if(nx < 0 || nx >= w || ny < 0 || ny >= h) continue;
+                int n = v + HOP_DX[i] + HOP_DY[i]*st;
+                uint16_t best = DIST_INF;
+                uint8_t dir = HOP_STAY;
+                for(int j=0; j<8; j++){
+                    uint16_t dv = dd[n + HOP_DX[j] + HOP_DY[j]*st];
+                    if(dv < best) {
+                        best = dv;
+                        dir = (uint8_t)j;
                     }
                 }
+                hp[n] = dir;
             }
         }
+        changedCells.clear();
     }
+};
 
-    PC* getPC() {
-        for(auto c : characters) {
-            if(c->type == Character::PC_TYPE) {
-                return dynamic_cast<PC*>(c);
-            }
+// What the player sees. The base class draws nothing, which is what headless
+// runs use; CursesDisplay is the ncurses UI.
+class Display {
+public:
+    virtual ~Display() {}
+    // Map around the PC (or the teleport cursor) plus a one-line prompt
+    virtual void drawMap(Dungeon &, PC &, bool /*showAll*/, bool /*showCursor*/,
+                         const char * /*prompt*/) {}
+    virtual void showMonsterList(Dungeon &, PC &) {}
+    virtual void showEnd(Dungeon &) {}
+};
+
+// Where the PC's keystrokes come from: getch() when playing, or a script,
+// random walk or stairs-seeker when running headless.
+class PCController {
+public:
+    virtual ~PCController() {}
+    // Next key for the PC, using the same codes getch() returns
+    virtual int nextKey(Dungeon &d, PC &pc) = 0;
+    // True once the controller has nothing more to say (end of a script)
+    virtual bool finished() const { return false; }
+};
+
+static Display noDisplay;
+
+// Small fixed set of threads that live as long as the pool. submit() hands a
+// task to the next free worker; wait() blocks until every submitted task has
+// finished, so callers get a clean join point without creating threads.
+class WorkerPool {
+public:
+    explicit WorkerPool(int threads) : pending(0), stopping(false) {
+        for(int i=0; i<threads; i++){
+            workers.emplace_back([this]{ workerLoop(); });
         }
-        return nullptr;
     }
 
-    int countMonsters() const {
-        int count = 0;
-        for(auto c : characters) {
-            if(c->type == Character::NPC_TYPE && c->alive) {
-                count++;
-            }
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(auto &t : workers) {
+            t.join();
         }
-        return count;
     }
 
-    // Create PC
-    void createPC(int px, int py) {
-        PC *pc = new PC();
-        pc->x = px;
-        pc->y = py;
-        characters.push_back(pc);
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    int size() const { return (int)workers.size(); }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            tasks.push_back(std::move(task));
+            pending++;
+        }
+        wake.notify_one();
     }
 
-    // Create a monster on a random '.' location
-    void createMonster() {
-        int rx, ry;
-        do {
-            rx = rand() % WIDTH;
-            ry = rand() % HEIGHT;
-        } while(base_map[ry][rx] != '.');
-        uint8_t flags = rand() & 0x0F;
-        int spd = (rand()%16) + 5;
-        int mhp = 10;
-        NPC *m = new NPC(flags, rx, ry, spd, mhp);
-        characters.push_back(m);
+    void wait() {
+        std::unique_lock<std::mutex> lock(mtx);
+        done.wait(lock, [this]{ return pending == 0; });
     }
 
-    // The main event loop
-    void gameLoop() {
-        EventQueue eq;
-
-        // Insert all alive characters with next turn = 0
-        for(auto c : characters) {
-            if(c->alive) {
-                Event e;
-                e.time = 0;
-                e.c    = c;
-                eq.push(e);
-            }
-        }
-        int aliveMonsters = countMonsters();
-        int current_time  = 0;
-        changedFloor      = false; // reset each time we do a fresh loop
-        while(!eq.empty() && pc_is_alive && aliveMonsters > 0 && !changedFloor) {
-            Event e = eq.pop();
-            current_time = e.time;
-            Character *chr = e.c;
-            if(!chr->alive) {
-                continue;
-            }
-            chr->doTurn(*this);
+private:
+    std::vector<std::thread>          workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex                        mtx;
+    std::condition_variable           wake;
+    std::condition_variable           done;
+    int                               pending;
+    bool                              stopping;
 
-            if(!pc_is_alive) {
-                break;
+    void workerLoop() {
+        while(true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                wake.wait(lock, [this]{ return stopping || !tasks.empty(); });
+                if(stopping && tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
             }
-            if(chr->alive && !changedFloor) {
-                int next_time = current_time + (1000 / chr->speed);
-                Event ne { next_time, chr };
-                eq.push(ne);
+            task();
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                pending--;
             }
-
-            aliveMonsters = countMonsters();
+            done.notify_all();
         }
     }
-    void newLevel(int nummon) {
-        // Delete all existing characters and clear the vector to avoid double free.
-        for(auto c : characters) {
-            delete c;
-        }
-        characters.clear();
+};
 
-        // Reset the dungeon map and hardness.
-        for(int y=0; y<HEIGHT; y++){
-            for(int x=0; x<WIDTH; x++){
-                if(x==0 || x==WIDTH-1 || y==0 || y==HEIGHT-1){
-                    hardness[y][x] = 255;
-                    base_map[y][x] = ' ';
+class Dungeon {
+public:
+    int width, height;
+    // Every write goes through setHardness() so `open` stays in sync.
+    Grid<uint8_t>  hardness;
+    CellMask       open;        // bit set where hardness == 0
+    Grid<char>     base_map;
+    // Live characters on each cell, linked through Character::nextHere. Monsters
+    // don't block each other, so a cell can hold several.
+    Grid<CharHandle> occupants;
+    Grid<uint16_t> disTunneling;
+    Grid<uint16_t> disNonTunneling;
+    // Which way an intelligent monster on each cell steps (HOP_DX/HOP_DY),
+    // kept in step with the distance maps above.
+    Grid<uint8_t>  hopTunneling;
+    Grid<uint8_t>  hopNonTunneling;
+
+    
+    int pc_x, pc_y;
+
+    // Rooms
+    std::vector<Room> rooms;
+
+    // Room floor ('.') and corridor ('#') cells by Grid index, so random
+    // placement draws a cell in O(1) instead of guessing. Built from base_map
+    // on first use after the terrain is replaced, then kept in step by
+    // setCell(). cellSlot holds a '.' or '#' cell's place in its list.
+    std::vector<int32_t> roomCells, corridorCells;
+    std::vector<int32_t> cellSlot;
+    bool                 cellsIndexed;
+    // Cells that aren't immutable rock, for the random teleport. Play never
+    // changes them, so this is built on the first teleport of a floor.
+    std::vector<int32_t> passableCells;
+    bool                 passableIndexed;
+
+    // Stair data
+    int upCount, downCount;
+    int up_xCoord, up_yCoord;
+    int down_xCoord, down_yCoord;
+    int global_num_monsters;
+    // --rooms: rooms per level, 0 to scale with the map's area
+    int roomsWanted;
+    // The PC is held directly; this level's monsters are packed into one
+    // array that newLevel() empties in bulk.
+    PC               pc;
+    bool             hasPC;
+    std::vector<NPC> npcs;
+    int liveMonsters;
+    // This floor's pending turns. The first gameLoop on a floor schedules
+    // everyone at time 0; after that the wheel carries on across calls and
+    // visits, and characters are added to or cancelled from it as they
+    // arrive or die.
+    TimingWheel turnQueue;
+    bool        turnsStarted;
+
+    // PC alive or not
+    bool pc_is_alive;
+    bool changedFloor;
+    int  stairDir;      // +1 for '>', -1 for '<' when changedFloor is set
+
+    Display      *display;
+    PCController *controller;
+    // Bumped whenever the terrain is replaced wholesale (new level, load)
+    unsigned levelSerial;
+    // Seed the session started from, and the generator it drives
+    uint64_t seed;
+    Rng      rng;
+    // How far down this floor is; the first one is 0. A new floor n is built
+    // from floorSeed(seed, n).
+    int      depth;
+    // What built this floor: generateLevel(monsters) with roomsWanted ==
+    // rooms, straight after reseeding with seed. --delta saves keep just
+    // that and what has changed since. Not known for a loaded floor.
+    struct FloorOrigin {
+        bool     known = false;
+        uint64_t seed = 0;
+        int      monsters = 0;
+        int      rooms = 0;
+    };
+    FloorOrigin origin;
+    // Turn counters for headless runs; gameLoop stops once pcTurns reaches
+    // maxPcTurns (if that is >= 0).
+    long pcTurns, npcTurns;
+    long maxPcTurns;
+    // Run monsters through NPC::doTurn rather than the specialised kernels;
+    // --bench ai uses it to check the two agree.
+    bool referenceAI;
+    // --lod: monsters further than this from the PC (by their distance map)
+    // take their turns several at a time; 0 keeps everyone at full detail.
+    int  lodDistance;
+    // Monster updates gameLoop ran one turn at a time, and in batches
+    long fullUpdates, coarseUpdates;
+
+    DistanceMap nonTunnelPaths;
+    DistanceMap tunnelPaths;
+    // Set by --parallel-paths: one extra thread that computes the
+    // non-tunneling map while this thread does the tunneling one.
+    std::unique_ptr<WorkerPool> pathWorkers;
+    // Set by enablePrefetch(): builds the next floor while this one is played.
+    std::unique_ptr<LevelPrefetch> prefetch;
+    // Set by enableFloorStack(): floors that were left, to go back to.
+    std::unique_ptr<FloorStack> floorStack;
+
+    Dungeon(int w = DEFAULT_WIDTH, int h = DEFAULT_HEIGHT)
+        : pc(w, h),
+          nonTunnelPaths(DistanceMap::NON_TUNNELING, &hardness, &open, &disNonTunneling,
+                         &hopNonTunneling),
+          tunnelPaths(DistanceMap::TUNNELING, &hardness, &open, &disTunneling, &hopTunneling)
+    {
+        pc_is_alive = true;
+        global_num_monsters = DEFAULT_NUMMON;
+        roomsWanted = 0;
+        upCount = downCount = 0;
+        up_xCoord = up_yCoord = 0;
+        down_xCoord = down_yCoord = 0;
+        pc_x = pc_y = 0;
+        hasPC = false;
+        liveMonsters = 0;
+        turnsStarted = false;
+        changedFloor = false;
+        display = &noDisplay;
+        controller = nullptr;
+        levelSerial = 0;
+        seed = 0;
+        depth = 0;
+        stairDir = 1;
+        pcTurns = npcTurns = 0;
+        maxPcTurns = -1;
+        referenceAI = false;
+        lodDistance = 0;
+        fullUpdates = coarseUpdates = 0;
+        cellsIndexed = passableIndexed = false;
+        resize(w, h);
+    }
+
+    // (Re)allocate every grid for a w x h map and clear it. Only valid while
+    // there are no characters, i.e. before a level is generated or loaded.
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        hardness.assign(w, h, 255, 255);
+        open.assign(w, h);
+        base_map.assign(w, h, ' ');
+        occupants.assign(w, h, NO_CHAR, NO_CHAR);
+        disTunneling.assign(w, h, DIST_INF);
+        disNonTunneling.assign(w, h, DIST_INF);
+        hopTunneling.assign(w, h, HOP_STAY, HOP_STAY);
+        hopNonTunneling.assign(w, h, HOP_STAY, HOP_STAY);
+        cellsIndexed = passableIndexed = false;
+        nonTunnelPaths = DistanceMap(DistanceMap::NON_TUNNELING, &hardness, &open,
+                                     &disNonTunneling, &hopNonTunneling);
+        tunnelPaths = DistanceMap(DistanceMap::TUNNELING, &hardness, &open, &disTunneling,
+                                  &hopTunneling);
+    }
+
+    void reseed(uint64_t s) {
+        seed = s;
+        rng.reseed(s);
+    }
+
+    void setHardness(int x, int y, int hh) {
+        int idx = hardness.index(x, y);
+        hardness.at(idx) = (uint8_t)hh;
+        open.set(idx, hh == 0);
+    }
+
+    // Solid rock with an immutable border, ready for generateRooms().
+    void fillRock() {
+        for(int y=0; y<height; y++){
+            for(int x=0; x<width; x++){
+                if(x==0 || x==width-1 || y==0 || y==height-1){
+                    setHardness(x, y, 255);
                 } else {
-                    hardness[y][x] = (rand() % 254) + 1;
-                    base_map[y][x] = ' ';
+                    setHardness(x, y, rng.below(254) + 1);
                 }
+                base_map[y][x] = ' ';
             }
         }
-        room_count = 0;
+        rooms.clear();
         upCount = 0;
         downCount = 0;
+        terrainReplaced();
+    }
+
+    // Call after rewriting the terrain wholesale (new level, load).
+    void terrainReplaced() {
+        levelSerial++;
+        cellsIndexed = false;
+        passableIndexed = false;
+        origin = FloorOrigin();
+    }
+
+    // Writes one cell of base_map, keeping the cell lists in step. Everything
+    // that changes a cell once a floor exists (stairs, digging) uses this.
+    void setCell(int x, int y, char c) {
+        if(cellsIndexed) {
+            int idx = hardness.index(x, y);
+            if(std::vector<int32_t> *from = cellList(base_map[y][x])) {
+                int32_t at = cellSlot[idx];
+                int32_t last = from->back();
+                (*from)[at] = last;
+                cellSlot[last] = at;
+                from->pop_back();
+                cellSlot[idx] = -1;
+            }
+            if(std::vector<int32_t> *to = cellList(c)) {
+                cellSlot[idx] = (int32_t)to->size();
+                to->push_back(idx);
+            }
+        }
+        base_map[y][x] = c;
+    }
+
+    // A random cell out of the room floor and/or corridor lists, or false if
+    // both are empty.
+    bool drawCell(bool room, bool corridor, int &x, int &y) {
+        indexCells();
+        size_t nr = room ? roomCells.size() : 0;
+        size_t nc = corridor ? corridorCells.size() : 0;
+        if(nr + nc == 0) return false;
+        size_t k = rng.below((int)(nr + nc));
+        cellXY(k < nr ? roomCells[k] : corridorCells[k - nr], x, y);
+        return true;
+    }
+
+    // A random cell that isn't immutable rock, or false if there is none.
+    bool drawPassableCell(int &x, int &y) {
+        if(!passableIndexed) {
+            passableCells.clear();
+            for(int yy=0; yy<height; yy++){
+                for(int xx=0; xx<width; xx++){
+                    if(hardness[yy][xx] != 255) passableCells.push_back(hardness.index(xx, yy));
+                }
+            }
+            passableIndexed = true;
+        }
+        if(passableCells.empty()) return false;
+        cellXY(passableCells[rng.below((int)passableCells.size())], x, y);
+        return true;
+    }
+
+    void indexCells() {
+        if(cellsIndexed) return;
+        roomCells.clear();
+        corridorCells.clear();
+        cellSlot.assign(hardness.cellCount(), -1);
+        for(int y=0; y<height; y++){
+            for(int x=0; x<width; x++){
+                if(std::vector<int32_t> *l = cellList(base_map[y][x])) {
+                    int idx = hardness.index(x, y);
+                    cellSlot[idx] = (int32_t)l->size();
+                    l->push_back(idx);
+                }
+            }
+        }
+        cellsIndexed = true;
+    }
+
+    std::vector<int32_t> *cellList(char c) {
+        return c == '.' ? &roomCells : c == '#' ? &corridorCells : nullptr;
+    }
+
+    void cellXY(int idx, int &x, int &y) const {
+        x = idx % hardness.stride() - 1;
+        y = idx / hardness.stride() - 1;
+    }
+
+    // The distance maps hold pointers into this object.
+    Dungeon(const Dungeon &) = delete;
+    Dungeon &operator=(const Dungeon &) = delete;
+
+    bool inBounds(int x, int y) const {
+        return (x >= 0 && x < width && y >= 0 && y < height);
+    }
+    bool isImmutableRock(int x, int y) const {
+        return hardness[y][x] == 255;
+    }
+    bool isFloor(int x, int y) const {
+        char c = base_map[y][x];
+        return (c == '.' || c == '#' || c == '<' || c == '>');
+    }
+    bool pcCanWalkOn(char cell) const {
+        return (cell == '.' || cell == '#' || cell == '<' || cell == '>');
+    }
+
+    Character &character(CharHandle h) {
+        return h == PC_HANDLE ? static_cast<Character &>(pc) : npcs[h - 1];
+    }
+    const Character &character(CharHandle h) const {
+        return h == PC_HANDLE ? static_cast<const Character &>(pc) : npcs[h - 1];
+    }
+
+    // What a fully lit cell shows: the last character to arrive there, or the
+    // terrain.
+    char glyphAt(int x, int y) const {
+        CharHandle h = occupants[y][x];
+        return h != NO_CHAR ? character(h).symbol : base_map[y][x];
+    }
+
+    CharHandle occupantAt(int x, int y) const {
+        return occupants[y][x];
+    }
+
+    // Puts the monster in the pool and on the map at its (x, y). Handles are
+    // stable, but NPC references are not once the pool grows.
+    CharHandle addMonster(const NPC &m) {
+        npcs.push_back(m);
+        NPC &added = npcs.back();
+        added.handle = (CharHandle)npcs.size();
+        if(added.alive) {
+            linkOccupant(&added);
+            liveMonsters++;
+            if(turnsStarted) turnQueue.schedule(added.handle, turnQueue.now());
+        }
+        return added.handle;
+    }
+
+    void moveCharacter(Character *c, int nx, int ny) {
+        if(c->x == nx && c->y == ny) return;
+        unlinkOccupant(c);
+        c->x = nx;
+        c->y = ny;
+        linkOccupant(c);
+    }
+
+    void killCharacter(Character *c) {
+        if(!c->alive) return;
+        c->alive = false;
+        unlinkOccupant(c);
+        turnQueue.cancel(c->handle);
+        if(c->type == Character::PC_TYPE) {
+            pc_is_alive = false;
+        } else {
+            liveMonsters--;
+        }
+    }
+
+    // Everyone on (x,y) except `attacker` dies.
+    void killAllAt(int x, int y, Character *attacker) {
+        CharHandle h = occupants[y][x];
+        while(h != NO_CHAR) {
+            Character &c = character(h);
+            h = c.nextHere;
+            if(&c != attacker) killCharacter(&c);
+        }
+    }
+
+    // New arrivals go on the front of the cell's list.
+    void linkOccupant(Character *c) {
+        CharHandle &head = occupants[c->y][c->x];
+        c->prevHere = NO_CHAR;
+        c->nextHere = head;
+        if(head != NO_CHAR) character(head).prevHere = c->handle;
+        head = c->handle;
+    }
+
+    void unlinkOccupant(Character *c) {
+        if(c->prevHere != NO_CHAR) character(c->prevHere).nextHere = c->nextHere;
+        else                       occupants[c->y][c->x] = c->nextHere;
+        if(c->nextHere != NO_CHAR) character(c->nextHere).prevHere = c->prevHere;
+        c->prevHere = c->nextHere = NO_CHAR;
+    }
+
+    // Drops every character at once; the monster pool keeps its capacity.
+    void clearCharacters() {
+        npcs.clear();
+        hasPC = false;
+        pc.alive = false;
+        occupants.fill(NO_CHAR);
+        liveMonsters = 0;
+        turnQueue.clear();
+        turnsStarted = false;
+    }
+
+    // Dijkstra for tunnelers
+    void djikstraForTunnel(int x, int y) {
+        tunnelPaths.recompute(x, y);
+    }
+
+    // Dijkstra for non-tunnelers
+    void djikstraForNonTunnel(int x, int y) {
+        nonTunnelPaths.recompute(x, y);
+    }
+
+    void enableParallelPaths() {
+        if(!pathWorkers) {
+            pathWorkers.reset(new WorkerPool(1));
+        }
+    }
+
+    // Both maps read hardness and write their own array, so they can run at
+    // the same time. Returns only once both are done.
+    void runBothPaths(const std::function<void()> &nonTunnel,
+                      const std::function<void()> &tunnel) {
+        if(!pathWorkers) {
+            nonTunnel();
+            tunnel();
+            return;
+        }
+        pathWorkers->submit(nonTunnel);
+        tunnel();
+        pathWorkers->wait();
+    }
+
+    void recomputeDistanceMaps(int x, int y) {
+        runBothPaths([&]{ djikstraForNonTunnel(x, y); },
+                     [&]{ djikstraForTunnel(x, y); });
+    }
+
+    // Bring both distance maps up to date for a PC standing at (x,y). Only
+    // does work if the PC moved or something was dug since the last call.
+    void updateDistanceMaps(int x, int y) {
+        nonTunnelPaths.setSource(x, y);
+        tunnelPaths.setSource(x, y);
+        runBothPaths([&]{ nonTunnelPaths.update(); },
+                     [&]{ tunnelPaths.update(); });
+    }
+
+    // Must be called whenever hardness[y][x] is changed during play.
+    void hardnessChanged(int x, int y, int oldHardness) {
+        nonTunnelPaths.cellChanged(x, y, oldHardness);
+        tunnelPaths.cellChanged(x, y, oldHardness);
+    }
+
+    // The whole grid was replaced (load, new level); next update is a full pass.
+    void invalidatePaths() {
+        nonTunnelPaths.invalidate();
+        tunnelPaths.invalidate();
+    }
+
+    PC* getPC() {
+        return hasPC ? &pc : nullptr;
+    }
+
+    // FNV-1a over the terrain, every character and the turn counters. Two runs
+    // that end with the same hash ended in the same state; --replay uses it.
+    uint64_t stateHash() const {
+        uint64_t hsh = 0xcbf29ce484222325ULL;
+        auto mix = [&hsh](uint64_t v) {
+            for(int i=0; i<8; i++){
+                hsh ^= (v >> (8*i)) & 0xff;
+                hsh *= 0x100000001b3ULL;
+            }
+        };
+        for(int y=0; y<height; y++){
+            for(int x=0; x<width; x++){
+                mix(((uint64_t)hardness[y][x] << 8) | (unsigned char)base_map[y][x]);
+            }
+        }
+        auto mixChar = [&mix](const Character &c) {
+            mix(((uint64_t)c.x << 32) | (uint32_t)c.y);
+            mix(((uint64_t)c.hp << 16) | ((uint64_t)c.btype << 8) | c.alive);
+        };
+        if(hasPC) mixChar(pc);
+        for(const NPC &m : npcs) {
+            mixChar(m);
+        }
+        mix(pcTurns);
+        mix(npcTurns);
+        mix(levelSerial);
+        return hsh;
+    }
+
+    int countMonsters() const {
+        return liveMonsters;
+    }
+
+    // Where monster m heads for, or false if it has no idea where the PC
+    // is. Telepathic monsters always know. The rest see the PC only from a
+    // cell in the PC's field of view (one bit test; the view is as old as
+    // the distance maps, from the start of the PC's last turn) and otherwise
+    // make for where they last saw it, forgetting it once they get there.
+    bool pcTarget(NPC &m, bool telepathic, int &tx, int &ty) {
+        if(!hasPC || !pc.alive) return false;
+        if(telepathic || pc.isVisible(*this, m.x, m.y)) {
+            m.lastPcX = pc.x;
+            m.lastPcY = pc.y;
+        } else if(m.lastPcX < 0) {
+            return false;
+        } else if(m.x == m.lastPcX && m.y == m.lastPcY) {
+            m.lastPcX = m.lastPcY = -1;
+            return false;
+        }
+        tx = m.lastPcX;
+        ty = m.lastPcY;
+        return true;
+    }
+
+    // Create PC
+    void createPC(int px, int py) {
+        pc = PC(width, height);
+        pc.x = px;
+        pc.y = py;
+        pc.handle = PC_HANDLE;
+        hasPC = true;
+        linkOccupant(&pc);
+        // A loaded turn queue may already hold the PC's turn.
+        if(turnsStarted && !turnQueue.scheduled(PC_HANDLE)) {
+            turnQueue.schedule(PC_HANDLE, turnQueue.now());
+        }
+        // Monsters look for the PC before its first turn, too.
+        pc.fov.compute(hardness, px, py);
+    }
+
+    // Create a monster on a random '.' location; false if there are none
+    bool createMonster() {
+        int rx, ry;
+        if(!drawCell(true, false, rx, ry)) return false;
+        uint8_t flags = rng.below(16);
+        int spd = rng.below(16) + 5;
+        int mhp = 10;
+        addMonster(NPC(flags, rx, ry, spd, mhp));
+        return true;
+    }
+
+    // One monster turn, via the kernel for its behaviour bits
+    void npcTurn(NPC &m);
+
+    // How many turns m can take in one coarse update, or 0 if it is close
+    // enough to the PC to need every one. Per monster turn the gap on m's
+    // map closes by at most one of m's steps (up to MAX_EDGE_COST through
+    // rock for a tunneler, 1 otherwise) plus the PC's moves, which only
+    // cross open floor at cost 1 and number at most two (speed 10 against
+    // a speed-5 monster), so a batch ends before it could reach
+    // lodDistance. A monster that can't reach the PC at all (DIST_INF)
+    // isn't far, just walled off, and takes its turns one at a time. The
+    // batch also has to fit the timing wheel.
+    int coarseSteps(const NPC &m) const {
+        bool tunnels = (m.btype & 0x4) != 0;
+        const Grid<uint16_t> &dm = tunnels ? disTunneling : disNonTunneling;
+        if(dm[m.y][m.x] == DIST_INF) return 0;
+        int perTurn = (tunnels ? MAX_EDGE_COST : 1) + 2;
+        int steps = std::min(LOD_MAX_STEPS, (dm[m.y][m.x] - lodDistance) / perTurn);
+        steps = std::min(steps, MAX_TURN_DELAY / (1000 / m.speed));
+        return steps >= 2 ? steps : 0;
+    }
+
+    // steps of m's turns in one go
+    void coarseTurn(NPC &m, int steps);
+
+    // The main event loop. Runs this floor's turns until the PC dies, takes
+    // the stairs or runs out of turns, or the monsters are all dead; the next
+    // call picks up where this one stopped.
+    void gameLoop() {
+        if(!turnsStarted) {
+            if(hasPC && pc.alive) {
+                turnQueue.schedule(PC_HANDLE, 0);
+            }
+            for(const NPC &m : npcs) {
+                if(m.alive) {
+                    turnQueue.schedule(m.handle, 0);
+                }
+            }
+            turnsStarted = true;
+        }
+        changedFloor = false; // reset each time we do a fresh loop
+        while(!turnQueue.empty() && pc_is_alive && liveMonsters > 0 && !changedFloor &&
+              (maxPcTurns < 0 || pcTurns < maxPcTurns)) {
+            // The dead are cancelled as they die, so whoever comes up is alive.
+            Event e = turnQueue.pop();
+            Character &chr = character(e.who);
+            int steps = 1;
+            if(e.who == PC_HANDLE) {
+                pc.doTurn(*this);
+                pcTurns++;
+            } else {
+                NPC &m = npcs[e.who - 1];
+                int coarse = lodDistance > 0 ? coarseSteps(m) : 0;
+                if(coarse) {
+                    coarseTurn(m, coarse);
+                    coarseUpdates++;
+                    steps = coarse;
+                } else {
+                    npcTurn(m);
+                    fullUpdates++;
+                }
+                npcTurns += steps;
+            }
+
+            // A PC that took the stairs is rescheduled when it arrives back.
+            if(chr.alive && !changedFloor) {
+                turnQueue.schedule(e.who, e.time + steps * (1000 / chr.speed));
+            }
+        }
+    }
+    // Go one floor down, e.g. after the PC died or cleared this one.
+    void newLevel(int nummon) {
+        enterFloor(depth + 1, nummon);
+    }
+
+    // Follow the stairs the PC just took.
+    void takeStairs(int nummon) {
+        enterFloor(depth + stairDir, nummon);
+    }
+
+    // Leave this floor for floor `to`: the floor stack gets this one, and
+    // `to` comes back from it if it was visited before. Otherwise it is
+    // swapped in from the prefetcher if that built it, or generated here.
+    void enterFloor(int to, int nummon);
+
+    // Start building the next floor on a background thread.
+    void enablePrefetch();
+
+    // Keep left floors, up to budget bytes in memory and the rest as
+    // snapshot files in dir.
+    void enableFloorStack(size_t budget, const std::string &dir);
+
+    // A restored floor has the PC where it left; put it on the stairs it
+    // arrives by instead ('<' going down, '>' going up), alive again.
+    void placeArrival(int dir) {
+        int ax = pc.x, ay = pc.y;
+        if(dir > 0 && upCount > 0) {
+            ax = up_xCoord;
+            ay = up_yCoord;
+        } else if(dir < 0 && downCount > 0) {
+            ax = down_xCoord;
+            ay = down_yCoord;
+        }
+        if(pc.alive) {
+            moveCharacter(&pc, ax, ay);
+        } else {
+            pc.alive = true;
+            pc.x = ax;
+            pc.y = ay;
+            linkOccupant(&pc);
+        }
+        hasPC = true;
+        pc_is_alive = true;
+        pc_x = ax;
+        pc_y = ay;
+        pc.fov.compute(hardness, ax, ay);
+        // Monsters due at now() move before the PC, so they must chase where
+        // it stands, whichever way the floor came back.
+        recomputeDistanceMaps(ax, ay);
+        // The PC left without a next turn; it gets one as it arrives.
+        if(turnsStarted) turnQueue.schedule(PC_HANDLE, turnQueue.now());
+    }
+
+    // Trade floors with o (same size): terrain, rooms, stairs, characters and
+    // distance maps. o is left with this one's old floor.
+    void swapLevel(Dungeon &o) {
+        std::swap(hardness, o.hardness);
+        std::swap(open, o.open);
+        std::swap(base_map, o.base_map);
+        std::swap(occupants, o.occupants);
+        std::swap(disTunneling, o.disTunneling);
+        std::swap(disNonTunneling, o.disNonTunneling);
+        std::swap(hopTunneling, o.hopTunneling);
+        std::swap(hopNonTunneling, o.hopNonTunneling);
+        nonTunnelPaths.swapState(o.nonTunnelPaths);
+        tunnelPaths.swapState(o.tunnelPaths);
+        std::swap(pc_x, o.pc_x);
+        std::swap(pc_y, o.pc_y);
+        rooms.swap(o.rooms);
+        roomCells.swap(o.roomCells);
+        corridorCells.swap(o.corridorCells);
+        cellSlot.swap(o.cellSlot);
+        std::swap(cellsIndexed, o.cellsIndexed);
+        passableCells.swap(o.passableCells);
+        std::swap(passableIndexed, o.passableIndexed);
+        std::swap(upCount, o.upCount);
+        std::swap(downCount, o.downCount);
+        std::swap(up_xCoord, o.up_xCoord);
+        std::swap(up_yCoord, o.up_yCoord);
+        std::swap(down_xCoord, o.down_xCoord);
+        std::swap(down_yCoord, o.down_yCoord);
+        std::swap(pc, o.pc);
+        std::swap(hasPC, o.hasPC);
+        npcs.swap(o.npcs);
+        std::swap(liveMonsters, o.liveMonsters);
+        std::swap(turnQueue, o.turnQueue);
+        std::swap(turnsStarted, o.turnsStarted);
+        std::swap(origin, o.origin);
+        std::swap(pc_is_alive, o.pc_is_alive);
+        levelSerial++;
+        o.levelSerial++;
+    }
+
+    // A fresh level from rng: terrain, the PC in the first room and nummon
+    // monsters. Only touches this Dungeon, so batch workers can each run
+    // their own.
+    void generateLevel(int nummon) {
+        // Delete all existing characters and clear the vector to avoid double free.
+        clearCharacters();
+
+        // Reset the dungeon map and hardness.
+        fillRock();
         extern void generateRooms(Dungeon &d);
         extern void connectRoomsViaCorridor(Dungeon &d);
         extern void placeStairs(Dungeon &d);
@@ -519,62 +1859,87 @@ public:
         connectRoomsViaCorridor(*this);
         placeStairs(*this);
 
-        if(room_count > 0) {
+        if(!rooms.empty()) {
             pc_x = rooms[0].x;
             pc_y = rooms[0].y;
         } else {
             pc_x = 1;
             pc_y = 1;
         }
-        memcpy(dungeon, base_map, sizeof(dungeon));
-
         createPC(pc_x, pc_y);
 
-        for(int i=0; i<nummon; i++){
-            createMonster();
+        npcs.reserve(nummon);
+        for(int i=0; i<nummon && createMonster(); i++){
         }
         pc_is_alive = true;
-        djikstraForNonTunnel(pc_x, pc_y);
-        djikstraForTunnel(pc_x, pc_y);
     }
-};
 
-void PC::doTurn(Dungeon &d) {
-    d.djikstraForNonTunnel(x, y);
-    d.djikstraForTunnel(x, y);
+    // generateLevel from a fresh stream, remembering how so the floor can be
+    // built again. rng is left where generation finished.
+    void generateFromSeed(uint64_t s, int nummon) {
+        rng.reseed(s);
+        generateLevel(nummon);
+        origin.known = true;
+        origin.seed = s;
+        origin.monsters = nummon;
+        origin.rooms = roomsWanted;
+    }
+};
 
-    d.rebuildDisplay();
-    updateRemembered(d);
+// A spare Dungeon and one thread. start() builds a floor into the spare;
+// take() waits for it and swaps it into the played Dungeon if it is the
+// floor that was asked for.
+class LevelPrefetch {
+public:
+    LevelPrefetch(int w, int h) : spare(w, h), pool(1), started(false), seed(0), nummon(0),
+                                  rooms(0) {}
 
-    clear();
-    bool showAll = (noFog || teleporting);
-    for(int r=0; r<HEIGHT; r++){
-        move(r, 0);
-        for(int c=0; c<WIDTH; c++){
-            if(r == y && c == x) {
-                addch('@');
-            } else {
-                if(showAll) {
-                    addch(d.dungeon[r][c]);
-                } else {
-                    if(isVisible(c, r)) {
-                        addch(d.dungeon[r][c]);
-                    } else {
-                        addch(remembered_map[r][c]);
-                    }
-                }
-            }
+    void start(uint64_t floorSeed, int monsters, int roomCount) {
+        if(started && seed == floorSeed && nummon == monsters && rooms == roomCount) {
+            return;
         }
+        pool.wait();
+        started = true;
+        seed = floorSeed;
+        nummon = monsters;
+        rooms = roomCount;
+        pool.submit([this]{
+            spare.roomsWanted = rooms;
+            spare.generateFromSeed(seed, nummon);
+            spare.recomputeDistanceMaps(spare.pc_x, spare.pc_y);
+        });
     }
-    move(0,0);
-    if(!teleporting) {
-        printw("PC turn. (hjklyubn etc) 'f'=fog, 'g'=teleport, 'm'=list, 'Q'=quit");
-    } else {
-        printw("TELEPORT mode. Move cursor; 'g' or 'r' teleports, 'Q' quits");
+
+    bool take(Dungeon &d, uint64_t floorSeed, int monsters) {
+        pool.wait();
+        if(!started || seed != floorSeed || nummon != monsters || rooms != d.roomsWanted ||
+           spare.width != d.width || spare.height != d.height) {
+            return false;
+        }
+        started = false;
+        d.swapLevel(spare);
+        return true;
     }
-    refresh();
+
+private:
+    Dungeon    spare;
+    WorkerPool pool;     // after spare, so it is joined before spare goes
+    bool       started;
+    uint64_t   seed;
+    int        nummon;
+    int        rooms;
+};
+
+void PC::doTurn(Dungeon &d) {
+    d.updateDistanceMaps(x, y);
+
+    updateRemembered(d);
+
+    d.display->drawMap(d, *this, noFog || teleporting, false,
+                       teleporting ? "TELEPORT mode. Move cursor; 'g' or 'r' teleports, 'Q' quits"
+                                   : "PC turn. (hjklyubn etc) 'f'=fog, 'g'=teleport, 'm'=list, 'Q'=quit");
     while(true) {
-        int ch = getch();
+        int ch = d.controller->nextKey(d, *this);
         if(teleporting) {
             // TELEPORT MODE
             switch(ch) {
@@ -628,59 +1993,30 @@ void PC::doTurn(Dungeon &d) {
                     break;
                 case 'g':
                     if(!d.isImmutableRock(teleportXCoordinates, teleportYCoordinates)) {
-                        x = teleportXCoordinates;
-                        y = teleportYCoordinates;
+                        d.moveCharacter(this, teleportXCoordinates, teleportYCoordinates);
                     }
                     teleporting = false;
                     return; // used turn
-                case 'r':
-                    while(true) {
-                        int rx = rand()%WIDTH;
-                        int ry = rand()%HEIGHT;
-                        if(!d.isImmutableRock(rx, ry)) {
-                            x = rx;
-                            y = ry;
-                            break;
-                        }
+                case 'r': {
+                    int rx, ry;
+                    if(d.drawPassableCell(rx, ry)) {
+                        d.moveCharacter(this, rx, ry);
                     }
                     teleporting = false;
                     return; 
+                }
                 case 'f':
                     noFog = !noFog;
                     break;
                 case 'Q':
-                    alive = false;
-                    d.pc_is_alive = false;
+                    d.killCharacter(this);
                     return;
                 default:
                     break;
             }
             // Re-draw with '*'
-            d.rebuildDisplay();
-            clear();
-            for(int r=0; r<HEIGHT; r++){
-                move(r,0);
-                for(int c=0; c<WIDTH; c++){
-                    if(r == y && c == x) {
-                        addch('@');
-                    } else if(r == teleportYCoordinates && c == teleportXCoordinates) {
-                        addch('*');
-                    } else {
-                        if(noFog) {
-                            addch(d.dungeon[r][c]);
-                        } else {
-                            if(isVisible(c, r)) {
-                                addch(d.dungeon[r][c]);
-                            } else {
-                                addch(remembered_map[r][c]);
-                            }
-                        }
-                    }
-                }
-            }
-            move(0,0);
-            printw("TELEPORT mode. Move '*'. 'g'=teleport, 'r'=random, 'f'=fog, 'Q'=quit.");
-            refresh();
+            d.display->drawMap(d, *this, noFog, true,
+                               "TELEPORT mode. Move '*'. 'g'=teleport, 'r'=random, 'f'=fog, 'Q'=quit.");
         } else {
             // NORMAL MODE
             switch(ch) {
@@ -689,102 +2025,71 @@ void PC::doTurn(Dungeon &d) {
                     int nx = x-1, ny = y-1;
                     if(d.inBounds(nx, ny) && d.pcCanWalkOn(d.base_map[ny][nx])) {
                         // Attack monster if present
-                        for(auto &c : d.characters){
-                            if(c->alive && c->x == nx && c->y == ny && c != this) {
-                                c->alive = false;
-                                if(c->type == PC_TYPE) {
-                                    d.pc_is_alive = false;
-                                }
-                            }
-                        }
-                        x = nx; y = ny;
+                        d.killAllAt(nx, ny, this);
+                        d.moveCharacter(this, nx, ny);
                     }
                     return; 
                 }
                 case '8': case 'k': {
                     int nx = x, ny = y-1;
                     if(d.inBounds(nx, ny) && d.pcCanWalkOn(d.base_map[ny][nx])) {
-                        for(auto &c : d.characters){
-                            if(c->alive && c->x == nx && c->y == ny && c != this) {
-                                c->alive = false;
-                                if(c->type == PC_TYPE) d.pc_is_alive = false;
-                            }
-                        }
-                        x = nx; y = ny;
+                        // Attack monster if present
+                        d.killAllAt(nx, ny, this);
+                        d.moveCharacter(this, nx, ny);
                     }
                     return;
                 }
                 case '9': case 'u': {
                     int nx = x+1, ny = y-1;
                     if(d.inBounds(nx, ny) && d.pcCanWalkOn(d.base_map[ny][nx])) {
-                        for(auto &c : d.characters){
-                            if(c->alive && c->x == nx && c->y == ny && c != this) {
-                                c->alive = false;
-                                if(c->type == PC_TYPE) d.pc_is_alive = false;
-                            }
-                        }
-                        x = nx; y = ny;
+                        // Attack monster if present
+                        d.killAllAt(nx, ny, this);
+                        d.moveCharacter(this, nx, ny);
                     }
                     return;
                 }
                 case '6': case 'l': {
                     int nx = x+1, ny = y;
                     if(d.inBounds(nx, ny) && d.pcCanWalkOn(d.base_map[ny][nx])) {
-                        for(auto &c : d.characters){
-                            if(c->alive && c->x == nx && c->y == ny && c != this) {
-                                c->alive = false;
-                                if(c->type == PC_TYPE) d.pc_is_alive = false;
-                            }
-                        }
-                        x = nx; y = ny;
+                        // Attack monster if present
+                        d.killAllAt(nx, ny, this);
+                        d.moveCharacter(this, nx, ny);
                     }
                     return;
                 }
                 case '3': case 'n': {
                     int nx = x+1, ny = y+1;
                     if(d.inBounds(nx, ny) && d.pcCanWalkOn(d.base_map[ny][nx])) {
-                        for(auto &cc : d.characters){
-                            if(cc->alive && cc->x == nx && cc->y == ny && cc != this) {
-                                cc->alive = false;
-                            }
-                        }
-                        x = nx; y = ny;
+                        // Attack monster if present
+                        d.killAllAt(nx, ny, this);
+                        d.moveCharacter(this, nx, ny);
                     }
                     return;
                 }
                 case '2': case 'j': {
                     int nx = x, ny = y+1;
                     if(d.inBounds(nx, ny) && d.pcCanWalkOn(d.base_map[ny][nx])) {
-                        for(auto &cc : d.characters){
-                            if(cc->alive && cc->x == nx && cc->y == ny && cc != this) {
-                                cc->alive = false;
-                            }
-                        }
-                        x = nx; y = ny;
+                        // Attack monster if present
+                        d.killAllAt(nx, ny, this);
+                        d.moveCharacter(this, nx, ny);
                     }
                     return;
                 }
                 case '1': case 'b': {
                     int nx = x-1, ny = y+1;
                     if(d.inBounds(nx, ny) && d.pcCanWalkOn(d.base_map[ny][nx])) {
-                        for(auto &cc : d.characters){
-                            if(cc->alive && cc->x == nx && cc->y == ny && cc != this) {
-                                cc->alive = false;
-                            }
-                        }
-                        x = nx; y = ny;
+                        // Attack monster if present
+                        d.killAllAt(nx, ny, this);
+                        d.moveCharacter(this, nx, ny);
                     }
                     return;
                 }
                 case '4': case 'h': {
                     int nx = x-1, ny = y;
                     if(d.inBounds(nx, ny) && d.pcCanWalkOn(d.base_map[ny][nx])) {
-                        for(auto &cc : d.characters){
-                            if(cc->alive && cc->x == nx && cc->y == ny && cc != this) {
-                                cc->alive = false;
-                            }
-                        }
-                        x = nx; y = ny;
+                        // Attack monster if present
+                        d.killAllAt(nx, ny, this);
+                        d.moveCharacter(this, nx, ny);
                     }
                     return;
                 }
@@ -796,65 +2101,20 @@ void PC::doTurn(Dungeon &d) {
                 case '>': {
                     if(d.base_map[y][x] == '>') {
                         d.changedFloor = true;
+                        d.stairDir = 1;
                     }
                     return; 
                 }
                 case '<': {
                     if(d.base_map[y][x] == '<') {
                         d.changedFloor = true;
+                        d.stairDir = -1;
                     }
                     return;
                 }
-                case 'm': {
-                    clear();
-                    printw("--- Monster List (ESC=exit, up/down=scroll) ---\n");
-                    std::vector<std::string> lines;
-                    for(auto c : d.characters) {
-                        if(c->type == Character::NPC_TYPE && c->alive) {
-                            int dx = c->x - x;
-                            int dy = c->y - y;
-                            std::string dir;
-                            if(dy < 0) dir += std::to_string(-dy) + " north ";
-                            if(dy > 0) dir += std::to_string(dy) + " south ";
-                            if(dx < 0) dir += std::to_string(-dx) + " west ";
-                            if(dx > 0) dir += std::to_string(dx) + " east ";
-                            if(dx == 0 && dy == 0) dir = "Same cell??";
-                            char buf[128];
-                            snprintf(buf, sizeof(buf), "%c: %s", c->symbol, dir.c_str());
-                            lines.push_back(buf);
-                        }
-                    }
-                    int offset = 0;
-                    const int LINES_AVAIL = 20;
-                    bool done = false;
-                    while(!done) {
-                        clear();
-                        mvprintw(0,0,"--- Monster List (ESC=exit, up/down=scroll) ---");
-                        int line=1;
-                        for(int i=0; i<LINES_AVAIL; i++){
-                            int idx = offset + i;
-                            if(idx >= (int)lines.size()) break;
-                            mvprintw(line++, 0, "%s", lines[idx].c_str());
-                        }
-                        refresh();
-                        int ckey = getch();
-                        switch(ckey) {
-                            case 27:
-                                done=true; break;
-                            case KEY_UP:
-                                if(offset > 0) offset--;
-                                break;
-                            case KEY_DOWN:
-                                if(offset + LINES_AVAIL < (int)lines.size()) offset++;
-                                break;
-                            default:
-                                break;
-                        }
-                    }
-                    // re-draw
-                    d.rebuildDisplay();
+                case 'm':
+                    d.display->showMonsterList(d, *this);
                     return;
-                }
                 case 'f':
                     noFog = !noFog;
                     return;
@@ -864,8 +2124,7 @@ void PC::doTurn(Dungeon &d) {
                     teleportYCoordinates = y;
                     return;
                 case 'Q':
-                    alive = false;
-                    d.pc_is_alive = false;
+                    d.killCharacter(this);
                     return;
                 default:
                     // ignore
@@ -875,16 +2134,18 @@ void PC::doTurn(Dungeon &d) {
     }
 }
 void PC::updateRemembered(Dungeon &d) {
-    for(int ry = y - PC_LIGHT_RADIUS; ry <= y + PC_LIGHT_RADIUS; ry++) {
-        for(int rx = x - PC_LIGHT_RADIUS; rx <= x + PC_LIGHT_RADIUS; rx++) {
-            if(d.inBounds(rx, ry)) {
-                if(isVisible(rx, ry)) {
-                    remembered_map[ry][rx] = d.base_map[ry][rx];
-                }
-            }
+    fov.compute(d.hardness, x, y);
+    for(const CellOffset &o : LIGHT_DISK) {
+        int rx = x + o.dx, ry = y + o.dy;
+        if(fov.visible(d.hardness, rx, ry)) {
+            remembered_map[ry][rx] = d.base_map[ry][rx];
         }
     }
 }
+
+bool PC::isVisible(const Dungeon &d, int x2, int y2) const {
+    return fov.visible(d.hardness, x2, y2);
+}
 void NPC::doTurn(Dungeon &d) {
     if(!alive) return;
 
@@ -894,471 +2155,2849 @@ void NPC::doTurn(Dungeon &d) {
     bool erratic      = (btype & 0x8);
 
     bool do_random = false;
-    if(erratic && (rand()%2 == 0)) {
+    if(erratic && d.rng.below(2) == 0) {
         do_random = true;
     }
     int bestx = x;
     int besty = y;
+    int tx = x, ty = y;
+    bool knows = !do_random && d.pcTarget(*this, telepathic, tx, ty);
+    // Following the distance maps means knowing where the PC is now.
+    bool sees = knows && tx == d.pc.x && ty == d.pc.y;
 
     if(do_random) {
-        int rr = rand() % 9;
+        int rr = d.rng.below(9);
         static int ddx[9] = {0,-1,1,0,0,-1,-1,1,1};
         static int ddy[9] = {0,0,0,-1,1,-1,1,-1,1};
         bestx = x + ddx[rr];
         besty = y + ddy[rr];
-    } else if(!intelligence) {
-        int dx = (d.pc_x > x)? 1 : ((d.pc_x < x)? -1 : 0);
-        int dy = (d.pc_y > y)? 1 : ((d.pc_y < y)? -1 : 0);
+        // Never wander off the map (the pad is not a real cell).
+        if(!d.inBounds(bestx, besty)) {
+            bestx = x;
+            besty = y;
+        }
+    } else if(!knows) {
+        // Nothing to go on: wait.
+    } else if(!intelligence || !sees) {
+        int dx = (tx > x)? 1 : ((tx < x)? -1 : 0);
+        int dy = (ty > y)? 1 : ((ty < y)? -1 : 0);
         bestx = x + dx;
         besty = y + dy;
     } else {
-        int bestDist = INT32_MAX;
-        for(int i=-1; i<=1; i++){
-            for(int j=-1; j<=1; j++){
-                if(!(i==0 && j==0)) {
-                    int nx = x + j;
-                    int ny = y + i;
-                    if(d.inBounds(nx, ny)) {
-                        int dval = tunneling ? d.disTunneling[ny][nx]
-                                             : d.disNonTunneling[ny][nx];
-                        if(dval < bestDist) {
-                            bestDist = dval;
-                            bestx = nx;
-                            besty = ny;
-                        }
-                    }
-                }
+        // Same row-by-row neighbour order as before, so ties still go to
+        // the first one. Off-map neighbours are pad cells reading DIST_INF.
+        const Grid<uint16_t> &dm = tunneling ? d.disTunneling : d.disNonTunneling;
+        int st = dm.stride();
+        const int offs[8] = { -st-1, -st, -st+1, -1, 1, st-1, st, st+1 };
+        int here = dm.index(x, y);
+        int bestIdx = here;
+        int bestDist = DIST_INF;
+        for(int i=0; i<8; i++){
+            int dval = dm.at(here + offs[i]);
+            if(dval < bestDist) {
+                bestDist = dval;
+                bestIdx = here + offs[i];
             }
         }
+        bestx = bestIdx % st - 1;
+        besty = bestIdx / st - 1;
     }
     if(tunneling && d.hardness[besty][bestx] > 0 && d.hardness[besty][bestx] < 255) {
-        d.hardness[besty][bestx] -= 85;
-        if(d.hardness[besty][bestx] < 0) d.hardness[besty][bestx] = 0;
+        int oldHardness = d.hardness[besty][bestx];
+        d.setHardness(bestx, besty, std::max(0, oldHardness - 85));
         if(d.hardness[besty][bestx] == 0) {
-            d.base_map[besty][bestx] = '#';
+            d.setCell(bestx, besty, '#');
         }
+        d.hardnessChanged(bestx, besty, oldHardness);
         return; 
     }
-    if(d.pc_x == bestx && d.pc_y == besty) {
+    if(d.pc.x == bestx && d.pc.y == besty) {
         d.pc_is_alive = false;
     }
 
-    x = bestx;
-    y = besty;
-}
-static void fillRoom(Dungeon &d, int w, int h, int x, int y) {
-    for(int row=y; row<y+h; row++){
-        for(int col=x; col<x+w; col++){
-            d.base_map[row][col] = '.';
-            d.hardness[row][col] = 0;
-        }
-    }
+    d.moveCharacter(this, bestx, besty);
 }
 
-static bool isValidRoom(Dungeon &d, int w, int h, int x, int y) {
-    if(w<1 || h<1 || (w+x >= WIDTH-1) || (h+y >= HEIGHT-1)) {
-        return false;
+// NPC::doTurn with the behaviour bits fixed at compile time, one instance per
+// btype so each monster's turn runs straight-line code for its kind. Must stay
+// move-for-move (and random-draw-for-draw) identical to NPC::doTurn.
+template <unsigned B>
+static void npcKernel(Dungeon &d, NPC &m) {
+    constexpr bool intelligent = B & 0x1;
+    constexpr bool telepathic  = B & 0x2;
+    constexpr bool tunneling   = B & 0x4;
+    constexpr bool erratic     = B & 0x8;
+
+    if(!m.alive) return;
+    int x = m.x, y = m.y;
+    int bestx = x, besty = y;
+    int tx = x, ty = y;
+    if(erratic && d.rng.below(2) == 0) {
+        static const int ddx[9] = {0,-1,1,0,0,-1,-1,1,1};
+        static const int ddy[9] = {0,0,0,-1,1,-1,1,-1,1};
+        int rr = d.rng.below(9);
+        bestx = x + ddx[rr];
+        besty = y + ddy[rr];
+        if(!d.inBounds(bestx, besty)) {
+            bestx = x;
+            besty = y;
+        }
+    } else if(!d.pcTarget(m, telepathic, tx, ty)) {
+        // no idea where the PC is
+    } else if(!intelligent || tx != d.pc.x || ty != d.pc.y) {
+        bestx = x + ((tx > x) ? 1 : ((tx < x) ? -1 : 0));
+        besty = y + ((ty > y) ? 1 : ((ty < y) ? -1 : 0));
+    } else {
+        // The neighbour scan doTurn does is precomputed in the hop map.
+        const Grid<uint8_t> &hm = tunneling ? d.hopTunneling : d.hopNonTunneling;
+        uint8_t hop = hm[y][x];
+        bestx = x + HOP_DX[hop];
+        besty = y + HOP_DY[hop];
     }
-    for(int row=y; row<y+h; row++){
-        for(int col=x; col<x+w; col++){
-            if(d.base_map[row][col] != ' ') {
-                return false;
+    if(tunneling) {
+        int oldHardness = d.hardness[besty][bestx];
+        if(oldHardness > 0 && oldHardness < 255) {
+            int hh = std::max(0, oldHardness - 85);
+            d.setHardness(bestx, besty, hh);
+            if(hh == 0) {
+                d.setCell(bestx, besty, '#');
             }
+            d.hardnessChanged(bestx, besty, oldHardness);
+            return;
         }
     }
-    return true;
+    if(d.pc.x == bestx && d.pc.y == besty) {
+        d.pc_is_alive = false;
+    }
+    d.moveCharacter(&m, bestx, besty);
 }
 
-void generateRooms(Dungeon &d) {
-    int attempts = 2000;
-    int c = 0;
-    while(attempts > 0 && c < 6) {
-        int rw = (rand()%6)+4;
-        int rh = (rand()%4)+3;
-        int rx = (rand()%(WIDTH - rw - 2))+1;
-        int ry = (rand()%(HEIGHT - rh - 2))+1;
-        if(isValidRoom(d, rw, rh, rx, ry)) {
+typedef void (*NPCKernel)(Dungeon &, NPC &);
+
+template <unsigned... B>
+struct NPCKernelTable {
+    static constexpr NPCKernel kernels[sizeof...(B)] = { &npcKernel<B>... };
+};
+
+static const NPCKernel *const NPC_KERNELS =
+    NPCKernelTable<0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15>::kernels;
+
+void Dungeon::npcTurn(NPC &m) {
+    if(referenceAI) {
+        m.doTurn(*this);
+    } else {
+        NPC_KERNELS[m.btype & 0x0F](*this, m);
+    }
+}
+
+// A far monster's turns, several at once and cheaper than npcTurn each time:
+// where it is heading is worked out once, an erratic monster's wandering is
+// taken as making no progress on every other step (so no random draws), and
+// it is moved on the map once at the end. Digging is the same as a full
+// turn. A step onto the PC ends the walk short of it, leaving any kill to a
+// full turn.
+void Dungeon::coarseTurn(NPC &m, int steps) {
+    bool intelligent = m.btype & 0x1;
+    bool telepathic  = m.btype & 0x2;
+    bool tunneling   = m.btype & 0x4;
+    bool erratic     = m.btype & 0x8;
+
+    int tx, ty;
+    if(!pcTarget(m, telepathic, tx, ty)) return;
+    bool follow = intelligent && tx == pc.x && ty == pc.y;
+    const Grid<uint8_t> &hm = tunneling ? hopTunneling : hopNonTunneling;
+    int x = m.x, y = m.y;
+    for(int i=0; i<steps && (x != tx || y != ty); i++){
+        if(erratic && (i & 1)) continue;
+        int nx, ny;
+        if(follow) {
+            uint8_t hop = hm[y][x];
+            nx = x + HOP_DX[hop];
+            ny = y + HOP_DY[hop];
+        } else {
+            nx = x + ((tx > x) ? 1 : ((tx < x) ? -1 : 0));
+            ny = y + ((ty > y) ? 1 : ((ty < y) ? -1 : 0));
+        }
+        if(nx == pc.x && ny == pc.y) break;
+        int oldHardness = hardness[ny][nx];
+        if(tunneling && oldHardness > 0 && oldHardness < 255) {
+            int hh = std::max(0, oldHardness - 85);
+            setHardness(nx, ny, hh);
+            if(hh == 0) {
+                setCell(nx, ny, '#');
+            }
+            hardnessChanged(nx, ny, oldHardness);
+            continue;
+        }
+        x = nx;
+        y = ny;
+    }
+    moveCharacter(&m, x, y);
+}
+
+// Movement keys indexed like DIRS8 below
+static const int DIR_KEYS[8] = { 'y', 'k', 'u', 'h', 'l', 'b', 'j', 'n' };
+static const int DIRS8[8][2] = {
+    {-1,-1},{0,-1},{1,-1},{-1,0},{1,0},{-1,1},{0,1},{1,1}
+};
+
+// Plays back a fixed list of keys (a --script string or a --replay log),
+// then quits.
+class ScriptedController : public PCController {
+public:
+    explicit ScriptedController(const std::string &k) : keys(k.begin(), k.end()), pos(0) {
+        for(auto &key : keys) key = (unsigned char)key;
+    }
+    explicit ScriptedController(const std::vector<int> &k) : keys(k), pos(0) {}
+
+    int nextKey(Dungeon &, PC &) override {
+        if(pos < keys.size()) {
+            return keys[pos++];
+        }
+        pos = keys.size() + 1;
+        return 'Q';
+    }
+    bool finished() const override { return pos > keys.size(); }
+
+private:
+    std::vector<int> keys;
+    size_t           pos;
+};
+
+// Passes another controller's keys through and appends each one to a log,
+// for --record.
+class RecordingController : public PCController {
+public:
+    RecordingController(PCController &in, std::vector<int> &out) : inner(in), log(out) {}
+
+    int nextKey(Dungeon &d, PC &pc) override {
+        int key = inner.nextKey(d, pc);
+        log.push_back(key);
+        return key;
+    }
+    bool finished() const override { return inner.finished(); }
+
+private:
+    PCController     &inner;
+    std::vector<int> &log;
+};
+
+// Random walk that takes any stairs it steps on. It has its own generator so
+// its choices don't shift the dungeon's random stream.
+class RandomController : public PCController {
+public:
+    explicit RandomController(uint64_t seed) : rng(seed) {}
+
+    int nextKey(Dungeon &d, PC &pc) override {
+        char here = d.base_map[pc.y][pc.x];
+        if(here == '>' || here == '<') {
+            return here;
+        }
+        return DIR_KEYS[rng.below(8)];
+    }
+
+private:
+    Rng rng;
+};
+
+// Walks the shortest path to the down stairs (the up stairs if the level has
+// none) and takes them. The distance-to-stairs map is built once per level;
+// digging only ever opens cells, so it stays a valid guide.
+class GreedyStairsController : public PCController {
+public:
+    explicit GreedyStairsController(uint64_t seed) : rng(seed), serial(0), tx(-1), ty(-1) {}
+
+    int nextKey(Dungeon &d, PC &pc) override {
+        if(serial != d.levelSerial || toStairs.width() != d.width ||
+           toStairs.height() != d.height) {
+            build(d);
+        }
+        if(tx < 0) {
+            return DIR_KEYS[rng.below(8)];
+        }
+        if(pc.x == tx && pc.y == ty) {
+            return d.base_map[ty][tx];
+        }
+        int best = -1;
+        int bestDist = toStairs[pc.y][pc.x];
+        for(int i=0; i<8; i++){
+            int nx = pc.x + DIRS8[i][0];
+            int ny = pc.y + DIRS8[i][1];
+            if(toStairs[ny][nx] < bestDist) {
+                bestDist = toStairs[ny][nx];
+                best = i;
+            }
+        }
+        return best >= 0 ? DIR_KEYS[best] : DIR_KEYS[rng.below(8)];
+    }
+
+private:
+    Rng              rng;
+    Grid<int>        toStairs;
+    std::vector<int> frontier;
+    unsigned         serial;
+    int              tx, ty;
+
+    void build(Dungeon &d) {
+        serial = d.levelSerial;
+        toStairs.assign(d.width, d.height, INT32_MAX);
+        tx = ty = -1;
+        if(d.downCount > 0) {
+            tx = d.down_xCoord; ty = d.down_yCoord;
+        } else if(d.upCount > 0) {
+            tx = d.up_xCoord; ty = d.up_yCoord;
+        }
+        if(tx < 0) return;
+        frontier.clear();
+        frontier.push_back(toStairs.index(tx, ty));
+        toStairs[ty][tx] = 0;
+        int st = toStairs.stride();
+        for(size_t k=0; k<frontier.size(); k++){
+            int u = frontier[k];
+            int ux = u % st - 1, uy = u / st - 1;
+            for(int i=0; i<8; i++){
+                int nx = ux + DIRS8[i][0];
+                int ny = uy + DIRS8[i][1];
+                if(!d.inBounds(nx, ny) || !d.pcCanWalkOn(d.base_map[ny][nx])) continue;
+                if(toStairs[ny][nx] != INT32_MAX) continue;
+                toStairs[ny][nx] = toStairs.at(u) + 1;
+                frontier.push_back(toStairs.index(nx, ny));
+            }
+        }
+    }
+};
+
+#ifndef RLG_HEADLESS
+// Top-left map coordinate of a screenSize-wide window that keeps focus
+// centred, clamped so it never scrolls past the edge of the map.
+static int viewOrigin(int focus, int mapSize, int screenSize) {
+    if(mapSize <= screenSize) return 0;
+    int o = focus - screenSize/2;
+    return std::max(0, std::min(o, mapSize - screenSize));
+}
+
+// Draws the map by diffing against the last frame it put on screen, so a turn
+// where one monster moved sends a handful of characters instead of a full
+// repaint. Anything else that draws on stdscr must call invalidate().
+class CursesDisplay : public Display {
+public:
+    CursesDisplay() : frameW(0), frameH(0) {
+        initscr();
+        cbreak();
+        noecho();
+        keypad(stdscr, TRUE);
+        curs_set(0);
+        start_color();
+    }
+    ~CursesDisplay() {
+        endwin();
+    }
+
+    void drawMap(Dungeon &d, PC &pc, bool showAll, bool showCursor,
+                 const char *prompt) override {
+        int viewW = std::min(d.width, COLS);
+        int viewH = std::min(d.height, LINES);
+        int fx = pc.teleporting ? pc.teleportXCoordinates : pc.x;
+        int fy = pc.teleporting ? pc.teleportYCoordinates : pc.y;
+        int left = viewOrigin(fx, d.width, viewW);
+        int top  = viewOrigin(fy, d.height, viewH);
+
+        // Compose the whole screen as the old clear-and-redraw left it.
+        if(COLS != frameW || LINES != frameH) {
+            invalidate();
+        }
+        // Fogged, that is the remembered map with the lit disk laid over it.
+        next.assign((size_t)COLS * LINES, ' ');
+        for(int sr=0; sr<viewH; sr++){
+            int r = top + sr;
+            char *out = &next[(size_t)sr * COLS];
+            if(showAll) {
+                for(int sc=0; sc<viewW; sc++){
+                    out[sc] = d.glyphAt(left + sc, r);
+                }
+            } else {
+                std::copy_n(&pc.remembered_map[r][left], viewW, out);
+            }
+        }
+        if(!showAll) {
+            int ox = pc.fov.originX(), oy = pc.fov.originY();
+            for(const CellOffset &o : LIGHT_DISK) {
+                int c = ox + o.dx, r = oy + o.dy;
+                if(c >= left && c < left + viewW && r >= top && r < top + viewH &&
+                   pc.isVisible(d, c, r)) {
+                    next[(size_t)(r - top) * COLS + (c - left)] = d.glyphAt(c, r);
+                }
+            }
+        }
+        auto put = [&](int c, int r, char ch) {
+            if(c >= left && c < left + viewW && r >= top && r < top + viewH) {
+                next[(size_t)(r - top) * COLS + (c - left)] = ch;
+            }
+        };
+        if(showCursor) {
+            put(pc.teleportXCoordinates, pc.teleportYCoordinates, '*');
+        }
+        put(pc.x, pc.y, '@');
+        // The prompt overwrites from the top-left and wraps like printw.
+        for(size_t i=0; prompt[i] && i<next.size(); i++){
+            next[i] = prompt[i];
+        }
+
+        if(shown.size() != next.size()) {
+            clear();
+            shown.assign(next.size(), '\0');
+        }
+        for(int sr=0; sr<LINES; sr++){
+            flushRow(sr);
+        }
+        std::swap(shown, next);
+        frameW = COLS;
+        frameH = LINES;
+        refresh();
+    }
+
+    // The screen no longer holds the last frame; the next drawMap repaints.
+    void invalidate() {
+        shown.clear();
+    }
+
+    void showMonsterList(Dungeon &d, PC &pc) override {
+        invalidate();
+        clear();
+        printw("--- Monster List (ESC=exit, up/down=scroll) ---\n");
+        std::vector<std::string> lines;
+        for(const NPC &m : d.npcs) {
+            if(m.alive) {
+                int dx = m.x - pc.x;
+                int dy = m.y - pc.y;
+                std::string dir;
+                if(dy < 0) dir += std::to_string(-dy) + " north ";
+                if(dy > 0) dir += std::to_string(dy) + " south ";
+                if(dx < 0) dir += std::to_string(-dx) + " west ";
+                if(dx > 0) dir += std::to_string(dx) + " east ";
+                if(dx == 0 && dy == 0) dir = "Same cell??";
+                char buf[128];
+                snprintf(buf, sizeof(buf), "%c: %s", m.symbol, dir.c_str());
+                lines.push_back(buf);
+            }
+        }
+        int offset = 0;
+        const int LINES_AVAIL = 20;
+        bool done = false;
+        while(!done) {
+            clear();
+            mvprintw(0,0,"--- Monster List (ESC=exit, up/down=scroll) ---");
+            int line=1;
+            for(int i=0; i<LINES_AVAIL; i++){
+                int idx = offset + i;
+                if(idx >= (int)lines.size()) break;
+                mvprintw(line++, 0, "%s", lines[idx].c_str());
+            }
+            refresh();
+            int ckey = getch();
+            switch(ckey) {
+                case 27:
+                    done=true; break;
+                case KEY_UP:
+                    if(offset > 0) offset--;
+                    break;
+                case KEY_DOWN:
+                    if(offset + LINES_AVAIL < (int)lines.size()) offset++;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    void showEnd(Dungeon &d) override {
+        invalidate();
+        clear();
+        if(!d.pc_is_alive) {
+            printw("You lose! The PC has been killed.\n");
+        }
+        printw("Press any key to quit...");
+        refresh();
+        getch();
+    }
+
+private:
+    std::vector<char> shown;   // what is on screen now, COLS*LINES
+    std::vector<char> next;    // the frame being drawn
+    int               frameW, frameH;
+
+    // Write row sr's changed cells. Changes closer together than a cursor
+    // move costs are merged into one run and sent with a single addnstr.
+    void flushRow(int sr) {
+        static const int MERGE_GAP = 4;
+        const char *want = &next[(size_t)sr * COLS];
+        const char *have = &shown[(size_t)sr * COLS];
+        int c = 0;
+        while(c < COLS) {
+            if(want[c] == have[c]) {
+                c++;
+                continue;
+            }
+            int start = c;
+            int end = c + 1;
+            for(int k=end; k<COLS && k-end < MERGE_GAP; k++){
+                if(want[k] != have[k]) end = k + 1;
+            }
+            mvaddnstr(sr, start, want + start, end - start);
+            c = end;
+        }
+    }
+};
+
+class CursesController : public PCController {
+public:
+    int nextKey(Dungeon &, PC &) override {
+        return getch();
+    }
+};
+#endif
+
+// Normal play: keep taking stairs until the PC dies, quits or clears a floor.
+static void playFloors(Dungeon &d) {
+    while(d.pc_is_alive) {
+        d.gameLoop();
+        if(!d.pc_is_alive) {
+            break;
+        }
+        if(d.changedFloor) {
+            d.takeStairs(d.global_num_monsters);
+        } else {
+            break;
+        }
+    }
+}
+
+struct HeadlessResult {
+    int    floors;
+    int    deaths;
+    double secs;
+};
+
+// Plays floor after floor with no UI until `floors` floors are done, the
+// PC has taken `turns` turns, or the controller runs out of input. A dead PC
+// just starts the next floor.
+static HeadlessResult playHeadless(Dungeon &d, PCController &ctl, int floors, long turns) {
+    d.controller = &ctl;
+    d.maxPcTurns = turns;
+    HeadlessResult r = { 0, 0, 0.0 };
+    auto start = std::chrono::steady_clock::now();
+    while(r.floors < floors) {
+        d.gameLoop();
+        if(turns >= 0 && d.pcTurns >= turns) break;
+        // Running out of script quits, which isn't a death.
+        if(ctl.finished()) break;
+        if(!d.pc_is_alive) r.deaths++;
+        r.floors++;
+        if(d.changedFloor) {
+            d.takeStairs(d.global_num_monsters);
+        } else {
+            d.newLevel(d.global_num_monsters);
+        }
+    }
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    r.secs = secs.count();
+    return r;
+}
+
+// playHeadless, then print throughput.
+static int runHeadless(Dungeon &d, PCController &ctl, int floors, long turns) {
+    HeadlessResult r = playHeadless(d, ctl, floors, turns);
+    long total = d.pcTurns + d.npcTurns;
+    printf("seed %llu  floors %d  deaths %d  pc turns %ld  monster turns %ld\n",
+           (unsigned long long)d.seed, r.floors, r.deaths, d.pcTurns, d.npcTurns);
+    printf("%.3f s  %.0f turns/sec  %.0f pc turns/sec\n", r.secs,
+           r.secs > 0 ? total / r.secs : 0.0,
+           r.secs > 0 ? d.pcTurns / r.secs : 0.0);
+    if(d.lodDistance > 0) {
+        printf("lod %d  full updates %ld  coarse updates %ld (%ld monster turns)\n",
+               d.lodDistance, d.fullUpdates, d.coarseUpdates, d.npcTurns - d.fullUpdates);
+    }
+    return 0;
+}
+
+static void fillRoom(Dungeon &d, int w, int h, int x, int y) {
+    for(int row=y; row<y+h; row++){
+        for(int col=x; col<x+w; col++){
+            d.setCell(col, row, '.');
+            d.setHardness(col, row, 0);
+        }
+    }
+}
+
+// Room sizes generateRooms draws from
+static const int ROOM_MIN_W = 4, ROOM_MAX_W = 9;
+static const int ROOM_MIN_H = 3, ROOM_MAX_H = 6;
+
+// Every top-left corner where a bw x bh box still fits in untouched rock,
+// so rooms are drawn only from places they fit instead of by trial and
+// error. The corners come from one summed-area table pass over the map;
+// after that claim() keeps the list exact by dropping the (bounded) set of
+// corners whose box a new room overlaps. A reverse index makes drawing and
+// dropping a corner O(1).
+class RoomPlacer {
+public:
+    RoomPlacer(const Dungeon &d, int bw, int bh) : w(d.width), h(d.height), bw(bw), bh(bh) {
+        std::vector<uint32_t> sat((size_t)(w+1) * (h+1), 0);
+        for(int y=0; y<h; y++){
+            uint32_t run = 0;
+            for(int x=0; x<w; x++){
+                run += d.base_map[y][x] != ' ';
+                sat[(size_t)(y+1)*(w+1) + x+1] = sat[(size_t)y*(w+1) + x+1] + run;
+            }
+        }
+        auto at = [&](int x, int y) { return sat[(size_t)y*(w+1) + x]; };
+        slot.assign((size_t)w*h, -1);
+        // Same bounds as before: a room may not touch the outer wall.
+        for(int y=1; y+bh <= h-2; y++){
+            for(int x=1; x+bw <= w-2; x++){
+                if(at(x+bw, y+bh) - at(x, y+bh) - at(x+bw, y) + at(x, y) == 0) {
+                    slot[(size_t)y*w + x] = (int32_t)corners.size();
+                    corners.push_back(y*w + x);
+                }
+            }
+        }
+    }
+
+    bool empty() const { return corners.empty(); }
+
+    // A free corner, uniformly at random
+    void draw(Rng &rng, int &x, int &y) const {
+        int32_t p = corners[rng.below((int)corners.size())];
+        x = p % w;
+        y = p / w;
+    }
+
+    // The rectangle is now a room: no box may overlap it any more.
+    void claim(int x, int y, int rw, int rh) {
+        for(int cy = std::max(0, y-bh+1); cy < y+rh && cy < h; cy++){
+            for(int cx = std::max(0, x-bw+1); cx < x+rw && cx < w; cx++){
+                drop(cy*w + cx);
+            }
+        }
+    }
+
+private:
+    void drop(int32_t p) {
+        int32_t i = slot[p];
+        if(i < 0) return;
+        int32_t last = corners.back();
+        corners[i] = last;
+        slot[last] = i;
+        corners.pop_back();
+        slot[p] = -1;
+    }
+
+    int w, h;
+    int bw, bh;
+    std::vector<int32_t> corners;
+    std::vector<int32_t> slot;   // cell -> index in corners, or -1
+};
+
+// 6 rooms on the classic 80x21 map, scaled up with the area on bigger maps
+// so they aren't mostly solid rock.
+static int roomTarget(const Dungeon &d) {
+    long area = (long)d.width * d.height;
+    return std::max(6, (int)(6 * area / (DEFAULT_WIDTH * DEFAULT_HEIGHT)));
+}
+
+static bool isValidRoom(Dungeon &d, int w, int h, int x, int y) {
+    if(w<1 || h<1 || (w+x >= d.width-1) || (h+y >= d.height-1)) {
+        return false;
+    }
+    for(int row=y; row<y+h; row++){
+        for(int col=x; col<x+w; col++){
+            if(d.base_map[row][col] != ' ') {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Misses in a row before generateRooms stops guessing
+static const int ROOM_MISS_LIMIT = 64;
+
+// Random guesses first: on a sparse map nearly every one lands, and that
+// beats an O(area) index. Once ROOM_MISS_LIMIT guesses in a row miss, the
+// map is crowded and the rest come from a RoomPlacer, first in boxes of the
+// largest room size and then, once those are gone, at the smallest size, so
+// --rooms can pack a map full in bounded time.
+void generateRooms(Dungeon &d) {
+    int target = d.roomsWanted > 0 ? d.roomsWanted : roomTarget(d);
+    d.rooms.clear();
+    int misses = 0;
+    while((int)d.rooms.size() < target && misses < ROOM_MISS_LIMIT) {
+        int rw = d.rng.below(ROOM_MAX_W - ROOM_MIN_W + 1) + ROOM_MIN_W;
+        int rh = d.rng.below(ROOM_MAX_H - ROOM_MIN_H + 1) + ROOM_MIN_H;
+        int rx = d.rng.below(d.width - rw - 2)+1;
+        int ry = d.rng.below(d.height - rh - 2)+1;
+        if(isValidRoom(d, rw, rh, rx, ry)) {
             fillRoom(d, rw, rh, rx, ry);
-            d.rooms[c].x = rx;
-            d.rooms[c].y = ry;
-            d.rooms[c].w = rw;
-            d.rooms[c].h = rh;
-            c++;
+            d.rooms.push_back(Room{rx, ry, rw, rh});
+            misses = 0;
+        } else {
+            misses++;
+        }
+    }
+    if((int)d.rooms.size() < target) {
+        RoomPlacer boxes(d, ROOM_MAX_W, ROOM_MAX_H);
+        while((int)d.rooms.size() < target && !boxes.empty()) {
+            int rw = d.rng.below(ROOM_MAX_W - ROOM_MIN_W + 1) + ROOM_MIN_W;
+            int rh = d.rng.below(ROOM_MAX_H - ROOM_MIN_H + 1) + ROOM_MIN_H;
+            int rx, ry;
+            boxes.draw(d.rng, rx, ry);
+            fillRoom(d, rw, rh, rx, ry);
+            d.rooms.push_back(Room{rx, ry, rw, rh});
+            boxes.claim(rx, ry, rw, rh);
+        }
+    }
+    if((int)d.rooms.size() < target) {
+        RoomPlacer gaps(d, ROOM_MIN_W, ROOM_MIN_H);
+        while((int)d.rooms.size() < target && !gaps.empty()) {
+            int rx, ry;
+            gaps.draw(d.rng, rx, ry);
+            fillRoom(d, ROOM_MIN_W, ROOM_MIN_H, rx, ry);
+            d.rooms.push_back(Room{rx, ry, ROOM_MIN_W, ROOM_MIN_H});
+            gaps.claim(rx, ry, ROOM_MIN_W, ROOM_MIN_H);
+        }
+    }
+}
+
+void connectRoomsViaCorridor(Dungeon &d) {
+    if(d.rooms.size() < 2) return;
+    for(size_t i=1; i<d.rooms.size(); i++){
+        int x1 = d.rooms[i-1].x + d.rooms[i-1].w/2;
+        int y1 = d.rooms[i-1].y + d.rooms[i-1].h/2;
+        int x2 = d.rooms[i].x + d.rooms[i].w/2;
+        int y2 = d.rooms[i].y + d.rooms[i].h/2;
+        while(x1 != x2){
+            if(d.inBounds(x1, y1)){
+                if(d.base_map[y1][x1] != '.') {
+                    d.setCell(x1, y1, '#');
+                    d.setHardness(x1, y1, 0);
+                }
+            }
+            x1 += (x2 > x1)? 1 : -1;
+        }
+        while(y1 != y2){
+            if(d.inBounds(x1, y1)){
+                if(d.base_map[y1][x1] != '.') {
+                    d.setCell(x1, y1, '#');
+                    d.setHardness(x1, y1, 0);
+                }
+            }
+            y1 += (y2 > y1)? 1 : -1;
+        }
+    }
+}
+
+// Up stairs, then down stairs, each on a random room or corridor cell.
+// Stairs take their cell out of the lists, so the two can't coincide; with
+// no such cell left the floor just goes without.
+void placeStairs(Dungeon &d) {
+    int x, y;
+    if(d.drawCell(true, true, x, y)) {
+        d.setCell(x, y, '<');
+        d.up_xCoord = x;
+        d.up_yCoord = y;
+        d.upCount = 1;
+    }
+    if(d.drawCell(true, true, x, y)) {
+        d.setCell(x, y, '>');
+        d.down_xCoord = x;
+        d.down_yCoord = y;
+        d.downCount = 1;
+    }
+}
+
+static void checkDir() {
+    char* home = getenv("HOME");
+    if(!home){
+        std::cerr << "ERROR: No HOME env var." << std::endl;
+        exit(1);
+    }
+    char path[1024];
+    snprintf(path,sizeof(path), "%s%s", home, DUNGEON_DIR);
+    if(mkdir(path,0700) && errno != EEXIST) {
+        std::cerr << "ERROR creating " << path << ": " << strerror(errno) << std::endl;
+        exit(1);
+    }
+}
+
+static void getPath(char* buf, size_t size) {
+    char* home = getenv("HOME");
+    snprintf(buf,size, "%s%s%s", home, DUNGEON_DIR, DUNGEON_FILE);
+}
+
+// Version 0 is the classic 80x21 layout with one-byte coordinates. Any
+// other size is saved as version 1, which adds width/height after the file
+// size, uses two-byte coordinates and four-byte room and monster counts.
+static const int FILE_VERSION_SIZED = 1;
+// Version 2 (--compact) is for archiving: varint numbers throughout, the
+// hardness map run-length coded, and the turn queue saved with the monsters.
+static const int FILE_VERSION_COMPACT = 2;
+// Version 3 (--delta) is the seed and settings a floor was generated from,
+// plus whatever play has changed since.
+static const int FILE_VERSION_DELTA = 3;
+
+enum SaveFormat { SAVE_CLASSIC, SAVE_COMPACT, SAVE_DELTA };
+
+// Big-endian image of a file, built in memory so it can be written in one
+// go. Same helpers the old FILE* code had, minus the stream.
+class ByteWriter {
+public:
+    std::vector<uint8_t> buf;
+
+    void putU8(uint8_t v) {
+        buf.push_back(v);
+    }
+    void putU16(uint16_t v) {
+        buf.push_back((uint8_t)(v >> 8));
+        buf.push_back((uint8_t)v);
+    }
+    void putU32(uint32_t v) {
+        putU16((uint16_t)(v >> 16));
+        putU16((uint16_t)v);
+    }
+    void putU64(uint64_t v) {
+        putU32((uint32_t)(v >> 32));
+        putU32((uint32_t)v);
+    }
+    void putBytes(const void *p, size_t n) {
+        const uint8_t *b = (const uint8_t *)p;
+        buf.insert(buf.end(), b, b + n);
+    }
+    void putCoord(int v, bool sized) {
+        if(sized) putU16((uint16_t)v);
+        else      putU8((uint8_t)v);
+    }
+    void putCount(uint32_t v, bool sized) {
+        if(sized) putU32(v);
+        else      putU16((uint16_t)v);
+    }
+    // LEB128: seven bits a byte, low bits first, top bit set on all but the
+    // last byte. Coordinates and counts on small maps take one byte.
+    void putVarint(uint64_t v) {
+        while(v >= 0x80) {
+            buf.push_back((uint8_t)(v | 0x80));
+            v >>= 7;
+        }
+        buf.push_back((uint8_t)v);
+    }
+};
+
+// Bounds-checked big-endian reads straight out of a buffer (usually a
+// MappedFile). Every getter returns false instead of reading past the end.
+class ByteReader {
+public:
+    ByteReader(const uint8_t *p, size_t n) : cur(p), end(p + n) {}
+
+    size_t remaining() const { return (size_t)(end - cur); }
+
+    // n bytes in place, or nullptr if there aren't that many left
+    const uint8_t *take(size_t n) {
+        if(remaining() < n) return nullptr;
+        const uint8_t *p = cur;
+        cur += n;
+        return p;
+    }
+    bool getU8(uint8_t &v) {
+        const uint8_t *p = take(1);
+        if(!p) return false;
+        v = p[0];
+        return true;
+    }
+    bool getU16(uint16_t &v) {
+        const uint8_t *p = take(2);
+        if(!p) return false;
+        v = (uint16_t)((p[0] << 8) | p[1]);
+        return true;
+    }
+    bool getU32(uint32_t &v) {
+        const uint8_t *p = take(4);
+        if(!p) return false;
+        v = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+        return true;
+    }
+    bool getU64(uint64_t &v) {
+        uint32_t hi, lo;
+        if(!getU32(hi) || !getU32(lo)) return false;
+        v = ((uint64_t)hi << 32) | lo;
+        return true;
+    }
+    bool getCoord(int &v, bool sized) {
+        if(sized) {
+            uint16_t c;
+            if(!getU16(c)) return false;
+            v = c;
+        } else {
+            uint8_t c;
+            if(!getU8(c)) return false;
+            v = c;
+        }
+        return true;
+    }
+    bool getCount(uint32_t &v, bool sized) {
+        if(sized) return getU32(v);
+        uint16_t c;
+        if(!getU16(c)) return false;
+        v = c;
+        return true;
+    }
+    // A putVarint value no bigger than max
+    bool getVarint(uint64_t &v, uint64_t max) {
+        v = 0;
+        for(int shift = 0; shift < 64; shift += 7) {
+            uint8_t b;
+            if(!getU8(b)) return false;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if(!(b & 0x80)) return v <= max;
+        }
+        return false;
+    }
+    bool getVarint(int &v, int max) {
+        uint64_t u;
+        if(!getVarint(u, (uint64_t)max)) return false;
+        v = (int)u;
+        return true;
+    }
+
+private:
+    const uint8_t *cur;
+    const uint8_t *end;
+};
+
+// Read-only mapping of a whole file, unmapped when it goes out of scope.
+class MappedFile {
+public:
+    MappedFile() : base(nullptr), len(0) {}
+    ~MappedFile() {
+        if(base) munmap(base, len);
+    }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const char *path) {
+        int fd = ::open(path, O_RDONLY);
+        if(fd < 0) {
+            std::cerr << "Error opening " << path << " for read: " << strerror(errno) << "\n";
+            return false;
+        }
+        struct stat st;
+        if(fstat(fd, &st) != 0) {
+            std::cerr << "Error reading " << path << ": " << strerror(errno) << "\n";
+            close(fd);
+            return false;
+        }
+        len = (size_t)st.st_size;
+        if(len > 0) {
+            void *m = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(m == MAP_FAILED) {
+                std::cerr << "Error mapping " << path << ": " << strerror(errno) << "\n";
+                close(fd);
+                len = 0;
+                return false;
+            }
+            base = m;
+        }
+        close(fd);
+        return true;
+    }
+
+    const uint8_t *data() const { return (const uint8_t *)base; }
+    size_t size() const { return len; }
+
+private:
+    void  *base;
+    size_t len;
+};
+
+// Writes buf to a temp file beside path and renames it over path, so anyone
+// reading path sees the old file or the new one, never half of one.
+static bool writeFileAtomic(const char *path, const std::vector<uint8_t> &buf) {
+    std::string tmp = std::string(path) + ".tmp." + std::to_string(getpid());
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0) {
+        std::cerr << "Error opening " << tmp << " for write: " << strerror(errno) << "\n";
+        return false;
+    }
+    const uint8_t *p = buf.data();
+    size_t left = buf.size();
+    int err = 0;
+    while(left > 0) {
+        ssize_t n = write(fd, p, left);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            err = errno;
+            break;
+        }
+        p += n;
+        left -= (size_t)n;
+    }
+    if(close(fd) != 0 && !err) err = errno;
+    if(!err && rename(tmp.c_str(), path) != 0) err = errno;
+    if(err) {
+        std::cerr << "Error writing " << path << ": " << strerror(err) << "\n";
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Hardness in row order as chunks that may cross rows: varint n<<1|1 and one
+// byte for n equal cells (room floor, corridors, the border), or varint n<<1
+// and n bytes as they are. Rock hardness is random, so it goes as literals.
+static void putHardnessRuns(ByteWriter &out, const Dungeon &d) {
+    std::vector<uint8_t> cells((size_t)d.width * d.height);
+    for(int r=0; r<d.height; r++){
+        memcpy(&cells[(size_t)r * d.width], d.hardness[r], d.width);
+    }
+    size_t n = cells.size(), lit = 0, i = 0;
+    auto flush = [&](size_t end) {
+        if(lit == end) return;
+        out.putVarint((uint64_t)(end - lit) << 1);
+        out.putBytes(&cells[lit], end - lit);
+    };
+    while(i < n) {
+        size_t run = 1;
+        while(i + run < n && cells[i + run] == cells[i]) run++;
+        if(run >= 3) {
+            flush(i);
+            out.putVarint(((uint64_t)run << 1) | 1);
+            out.putU8(cells[i]);
+            lit = i + run;
+        }
+        i += run;
+    }
+    flush(n);
+}
+
+static bool getHardnessRuns(ByteReader &in, std::vector<uint8_t> &cells) {
+    size_t at = 0;
+    while(at < cells.size()) {
+        uint64_t head;
+        if(!in.getVarint(head, (uint64_t)(cells.size() - at) * 2 + 1) || (head >> 1) == 0) {
+            return false;
+        }
+        size_t len = (size_t)(head >> 1);
+        if(head & 1) {
+            uint8_t v;
+            if(!in.getU8(v)) return false;
+            memset(&cells[at], v, len);
+        } else {
+            const uint8_t *p = in.take(len);
+            if(!p) return false;
+            memcpy(&cells[at], p, len);
+        }
+        at += len;
+    }
+    return true;
+}
+
+// Version 2. Monsters are numbered 1.. in the order they are written (0 is
+// the PC) so the turn queue can refer to them; it is written in the order
+// its turns will run, as offsets from its clock, so a loaded floor plays on
+// in the same order.
+static bool save_dungeon_compact(Dungeon &d, const char *path) {
+    ByteWriter out;
+    out.buf.reserve((size_t)d.width * d.height + 1024);
+    out.putBytes(FILE_MARKER, MARKER_LEN);
+    out.putU32(FILE_VERSION_COMPACT);
+    out.putU32(0);                      // file size, filled in below
+    out.putVarint(d.width);
+    out.putVarint(d.height);
+    // Where the PC is now, once it is on the map (pc_x/pc_y is where it
+    // arrived)
+    out.putVarint(d.hasPC ? d.pc.x : d.pc_x);
+    out.putVarint(d.hasPC ? d.pc.y : d.pc_y);
+    putHardnessRuns(out, d);
+
+    out.putVarint(d.rooms.size());
+    for(const Room &rm : d.rooms){
+        out.putVarint(rm.x);
+        out.putVarint(rm.y);
+        out.putVarint(rm.w);
+        out.putVarint(rm.h);
+    }
+    out.putVarint(d.upCount > 0 ? 1 : 0);
+    if(d.upCount > 0) {
+        out.putVarint(d.up_xCoord);
+        out.putVarint(d.up_yCoord);
+    }
+    out.putVarint(d.downCount > 0 ? 1 : 0);
+    if(d.downCount > 0) {
+        out.putVarint(d.down_xCoord);
+        out.putVarint(d.down_yCoord);
+    }
+
+    std::vector<uint32_t> fileIndex(d.npcs.size() + 1, 0);
+    out.putVarint((uint64_t)d.liveMonsters);
+    uint32_t written = 0;
+    for(const NPC &m : d.npcs){
+        if(!m.alive) continue;
+        fileIndex[m.handle] = ++written;
+        out.putVarint(m.x);
+        out.putVarint(m.y);
+        out.putU8((uint8_t)m.speed);
+        out.putVarint((uint64_t)std::max(0, m.hp));
+        out.putU8(m.btype);
+    }
+
+    out.putU8(d.turnsStarted);
+    if(d.turnsStarted) {
+        int now = d.turnQueue.now();
+        std::vector<std::pair<uint32_t, int>> turns;
+        turns.reserve(d.turnQueue.size());
+        d.turnQueue.forEach([&](CharHandle who, int time) {
+            if(who == PC_HANDLE) turns.emplace_back(0, time - now);
+            else if(d.character(who).alive) turns.emplace_back(fileIndex[who], time - now);
+        });
+        out.putVarint((uint64_t)now);
+        out.putVarint(turns.size());
+        for(auto &t : turns) {
+            out.putVarint(t.first);
+            out.putVarint((uint64_t)t.second);
+        }
+    }
+
+    uint32_t size = (uint32_t)out.buf.size();
+    for(int i=0; i<4; i++){
+        out.buf[MARKER_LEN + 4 + i] = (uint8_t)(size >> (24 - 8*i));
+    }
+    return writeFileAtomic(path, out.buf);
+}
+
+// What a version 3 file says changed about a monster
+static const uint8_t DELTA_DEAD  = 0x1;
+static const uint8_t DELTA_MOVED = 0x2;   // x, y
+static const uint8_t DELTA_HP    = 0x4;   // hp
+static const uint8_t DELTA_SEEN  = 0x8;   // where it last saw the PC, +1
+
+// Version 3, for a floor whose origin is known: the origin, then every cell
+// whose hardness or map character differs from a fresh build (as a gap from
+// the last one, hardness and character), every monster that died, moved,
+// was hurt or has seen the PC (gap, DELTA_ flags, the flagged fields), where
+// the PC is, and the turn queue as in version 2 but by handle. The loader
+// builds the floor again and patches it, so an untouched floor comes to a
+// few tens of bytes. Anything else is saved as version 2.
+static bool save_dungeon_delta(Dungeon &d, const char *path) {
+    std::unique_ptr<Dungeon> g;
+    if(d.origin.known) {
+        g.reset(new Dungeon(d.width, d.height));
+        g->roomsWanted = d.origin.rooms;
+        g->generateFromSeed(d.origin.seed, d.origin.monsters);
+    }
+    bool same = g && g->npcs.size() == d.npcs.size() && g->rooms.size() == d.rooms.size() &&
+                g->upCount == d.upCount && g->downCount == d.downCount;
+    for(size_t i=0; same && i<d.rooms.size(); i++){
+        const Room &a = d.rooms[i], &b = g->rooms[i];
+        same = a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h;
+    }
+    if(!same) {
+        std::cerr << path << ": this floor can't be rebuilt from a seed; saving it in full\n";
+        return save_dungeon_compact(d, path);
+    }
+
+    ByteWriter out;
+    out.putBytes(FILE_MARKER, MARKER_LEN);
+    out.putU32(FILE_VERSION_DELTA);
+    out.putU32(0);                      // file size, filled in below
+    out.putVarint(d.origin.seed);
+    out.putVarint(d.width);
+    out.putVarint(d.height);
+    out.putVarint(d.origin.monsters);
+    out.putVarint(d.origin.rooms);
+
+    std::vector<int> cells;
+    for(int r=0; r<d.height; r++){
+        for(int c=0; c<d.width; c++){
+            if(d.hardness[r][c] != g->hardness[r][c] || d.base_map[r][c] != g->base_map[r][c]) {
+                cells.push_back(r * d.width + c);
+            }
+        }
+    }
+    out.putVarint(cells.size());
+    int last = 0;
+    for(int idx : cells) {
+        out.putVarint(idx - last);
+        out.putU8(d.hardness[idx / d.width][idx % d.width]);
+        out.putU8((uint8_t)d.base_map[idx / d.width][idx % d.width]);
+        last = idx;
+    }
+
+    ByteWriter mons;
+    size_t changed = 0;
+    last = 0;
+    for(size_t i=0; i<d.npcs.size(); i++){
+        const NPC &m = d.npcs[i], &o = g->npcs[i];
+        uint8_t flags = 0;
+        if(!m.alive) {
+            flags = DELTA_DEAD;
+        } else {
+            if(m.x != o.x || m.y != o.y) flags |= DELTA_MOVED;
+            if(m.hp != o.hp)             flags |= DELTA_HP;
+            if(m.lastPcX >= 0)           flags |= DELTA_SEEN;
+        }
+        if(!flags) continue;
+        changed++;
+        mons.putVarint(i - last);
+        mons.putU8(flags);
+        if(flags & DELTA_MOVED) {
+            mons.putVarint(m.x);
+            mons.putVarint(m.y);
+        }
+        if(flags & DELTA_HP) {
+            mons.putVarint((uint64_t)std::max(0, m.hp));
+        }
+        if(flags & DELTA_SEEN) {
+            mons.putVarint(m.lastPcX + 1);
+            mons.putVarint(m.lastPcY + 1);
+        }
+        last = (int)i;
+    }
+    out.putVarint(changed);
+    out.putBytes(mons.buf.data(), mons.buf.size());
+
+    out.putVarint(d.hasPC ? d.pc.x : d.pc_x);
+    out.putVarint(d.hasPC ? d.pc.y : d.pc_y);
+    out.putU8(d.turnsStarted);
+    if(d.turnsStarted) {
+        int now = d.turnQueue.now();
+        out.putVarint((uint64_t)now);
+        out.putVarint(d.turnQueue.size());
+        d.turnQueue.forEach([&out, now](CharHandle who, int time) {
+            out.putVarint((uint64_t)who);
+            out.putVarint((uint64_t)(time - now));
+        });
+    }
+
+    uint32_t size = (uint32_t)out.buf.size();
+    for(int i=0; i<4; i++){
+        out.buf[MARKER_LEN + 4 + i] = (uint8_t)(size >> (24 - 8*i));
+    }
+    return writeFileAtomic(path, out.buf);
+}
+
+static bool save_dungeon(Dungeon &d, const char* path, SaveFormat format = SAVE_CLASSIC) {
+    if(format == SAVE_COMPACT) {
+        return save_dungeon_compact(d, path);
+    }
+    if(format == SAVE_DELTA) {
+        return save_dungeon_delta(d, path);
+    }
+    bool sized = !(d.width == DEFAULT_WIDTH && d.height == DEFAULT_HEIGHT);
+
+    uint16_t up_stairs_count = d.upCount>0 ? 1 : 0;
+    uint16_t down_stairs_count = d.downCount>0 ? 1 : 0;
+    uint32_t alive_monsters = d.liveMonsters;
+
+    // Version 0 files have always recorded two bytes less than they hold;
+    // kept so they stay byte-identical to what other readers expect.
+    uint32_t file_size;
+    if(!sized) {
+        file_size = 1702 + (d.rooms.size()*4) + 2 + (up_stairs_count*2) + 2 + (down_stairs_count*2);
+        file_size += 2 + alive_monsters*5;
+    } else {
+        file_size = MARKER_LEN + 4 + 4 + 4 + 4 + (uint32_t)d.width*d.height;
+        file_size += 4 + d.rooms.size()*8 + 2 + up_stairs_count*4 + 2 + down_stairs_count*4;
+        file_size += 4 + alive_monsters*7;
+    }
+
+    ByteWriter out;
+    out.buf.reserve(file_size + 2);
+    out.putBytes(FILE_MARKER, MARKER_LEN);
+    out.putU32(sized ? FILE_VERSION_SIZED : FILE_VERSION);
+    out.putU32(file_size);
+
+    if(sized) {
+        out.putU16((uint16_t)d.width);
+        out.putU16((uint16_t)d.height);
+    }
+    out.putCoord(d.pc_x, sized);
+    out.putCoord(d.pc_y, sized);
+
+    for(int r=0; r<d.height; r++){
+        out.putBytes(d.hardness[r], d.width);
+    }
+
+    out.putCount(d.rooms.size(), sized);
+    for(const Room &rm : d.rooms){
+        out.putCoord(rm.x, sized);
+        out.putCoord(rm.y, sized);
+        out.putCoord(rm.w, sized);
+        out.putCoord(rm.h, sized);
+    }
+
+    out.putU16(up_stairs_count);
+    if(up_stairs_count==1){
+        out.putCoord(d.up_xCoord, sized);
+        out.putCoord(d.up_yCoord, sized);
+    }
+    out.putU16(down_stairs_count);
+    if(down_stairs_count==1){
+        out.putCoord(d.down_xCoord, sized);
+        out.putCoord(d.down_yCoord, sized);
+    }
+    out.putCount(alive_monsters, sized);
+    for(const NPC &m : d.npcs){
+        if(m.alive){
+            out.putCoord(m.x, sized);
+            out.putCoord(m.y, sized);
+            out.putU8((uint8_t)m.speed);
+            out.putU8((uint8_t)m.hp);
+            out.putU8((uint8_t)m.btype);
+        }
+    }
+
+    return writeFileAtomic(path, out.buf);
+}
+
+// The rest of a version 2 file, after its header. Checked in full before d
+// is touched, like the older versions.
+static bool load_dungeon_compact(Dungeon &d, ByteReader &in, const char *path) {
+    auto bad = [path](const char *why) {
+        std::cerr << path << ": " << why << "\n";
+        return false;
+    };
+    int w = 0, h = 0, pcx = 0, pcy = 0;
+    if(!in.getVarint(w, MAX_DIMENSION) || !in.getVarint(h, MAX_DIMENSION) ||
+       w < MIN_WIDTH || h < MIN_HEIGHT) {
+        return bad("bad dungeon size");
+    }
+    if(!in.getVarint(pcx, w - 1) || !in.getVarint(pcy, h - 1)) {
+        return bad("PC is off the map");
+    }
+    std::vector<uint8_t> hard((size_t)w * h);
+    if(!getHardnessRuns(in, hard)) {
+        return bad("bad hardness map");
+    }
+
+    int r_count = 0;
+    if(!in.getVarint(r_count, (int)std::min<size_t>(in.remaining() / 4, INT32_MAX))) {
+        return bad("truncated room list");
+    }
+    std::vector<Room> rooms;
+    rooms.reserve(r_count);
+    for(int i=0; i<r_count; i++){
+        Room rm;
+        if(!in.getVarint(rm.x, w) || !in.getVarint(rm.y, h) || !in.getVarint(rm.w, w) ||
+           !in.getVarint(rm.h, h)) {
+            return bad("truncated room list");
+        }
+        if(rm.x + rm.w > w || rm.y + rm.h > h) continue;
+        rooms.push_back(rm);
+    }
+
+    int stairs[2][3] = { {0, 0, 0}, {0, 0, 0} };   // count, x, y for up, down
+    for(auto &st : stairs) {
+        if(!in.getVarint(st[0], 1) ||
+           (st[0] && (!in.getVarint(st[1], w - 1) || !in.getVarint(st[2], h - 1)))) {
+            return bad("truncated stairs");
+        }
+    }
+
+    // x, y, speed, hp, btype: five bytes at least
+    int monster_count = 0;
+    if(!in.getVarint(monster_count, (int)std::min<size_t>(in.remaining() / 5, INT32_MAX))) {
+        return bad("truncated monster list");
+    }
+    std::vector<NPC> monsters;
+    monsters.reserve(monster_count);
+    for(int i=0; i<monster_count; i++){
+        int mx = 0, my = 0, mhp = 0;
+        uint8_t mspeed = 0, mbtype = 0;
+        if(!in.getVarint(mx, w - 1) || !in.getVarint(my, h - 1) || !in.getU8(mspeed) ||
+           !in.getVarint(mhp, INT32_MAX) || !in.getU8(mbtype)) {
+            return bad("truncated monster list");
+        }
+        monsters.push_back(NPC(mbtype, mx, my, mspeed, mhp));
+    }
+
+    uint8_t started = 0;
+    int clock = 0, turn_count = 0;
+    std::vector<std::pair<int, int>> turns;
+    if(!in.getU8(started) || started > 1) {
+        return bad("truncated turn queue");
+    }
+    if(started) {
+        if(!in.getVarint(clock, INT32_MAX / 2) ||
+           !in.getVarint(turn_count, (int)std::min<size_t>(in.remaining() / 2, INT32_MAX))) {
+            return bad("truncated turn queue");
+        }
+        turns.resize(turn_count);
+        for(auto &t : turns) {
+            if(!in.getVarint(t.first, monster_count) ||
+               !in.getVarint(t.second, MAX_TURN_DELAY)) {
+                return bad("truncated turn queue");
+            }
+        }
+    }
+    if(in.remaining() != 0) {
+        return bad("unexpected bytes after the turn queue");
+    }
+
+    // The file is sound; replace the dungeon with it.
+    d.clearCharacters();
+    if(d.width != w || d.height != h) {
+        d.resize(w, h);
+    }
+    d.pc_x = pcx;
+    d.pc_y = pcy;
+    for(int r=0; r<h; r++){
+        for(int c=0; c<w; c++){
+            uint8_t hh = hard[(size_t)r*w + c];
+            d.setHardness(c, r, hh);
+            d.base_map[r][c] = hh == 0 ? '#' : ' ';
+        }
+    }
+    d.rooms = std::move(rooms);
+    for(const Room &rm : d.rooms){
+        for(int row = rm.y; row < rm.y + rm.h; row++){
+            std::fill_n(&d.base_map[row][rm.x], rm.w, '.');
+        }
+    }
+    d.upCount = stairs[0][0];
+    d.up_xCoord = stairs[0][1];
+    d.up_yCoord = stairs[0][2];
+    d.downCount = stairs[1][0];
+    d.down_xCoord = stairs[1][1];
+    d.down_yCoord = stairs[1][2];
+    if(d.upCount > 0) {
+        d.base_map[d.up_yCoord][d.up_xCoord] = '<';
+    }
+    if(d.downCount > 0) {
+        d.base_map[d.down_yCoord][d.down_xCoord] = '>';
+    }
+    d.invalidatePaths();
+    d.terrainReplaced();
+
+    // File index i+1 -> handle, NO_CHAR for monsters dropped like v0 drops
+    // them (speed 0 would divide by zero in the event loop)
+    std::vector<CharHandle> handleOf(monster_count + 1, NO_CHAR);
+    handleOf[0] = PC_HANDLE;
+    d.npcs.reserve(monster_count);
+    for(int i=0; i<monster_count; i++){
+        if(monsters[i].speed == 0) continue;
+        handleOf[i + 1] = d.addMonster(monsters[i]);
+    }
+    if(started) {
+        d.turnQueue.clear(clock);
+        for(auto &t : turns) {
+            if(handleOf[t.first] != NO_CHAR) {
+                d.turnQueue.schedule(handleOf[t.first], clock + t.second);
+            }
+        }
+        // Anyone the file left out moves next rather than never.
+        for(const NPC &m : d.npcs) {
+            if(!d.turnQueue.scheduled(m.handle)) d.turnQueue.schedule(m.handle, clock);
+        }
+        d.turnsStarted = true;
+    }
+    return true;
+}
+
+// The rest of a version 3 file. Everything is checked and the floor rebuilt
+// and patched off to the side before d is touched.
+static bool load_dungeon_delta(Dungeon &d, ByteReader &in, const char *path) {
+    auto bad = [path](const char *why) {
+        std::cerr << path << ": " << why << "\n";
+        return false;
+    };
+    uint64_t seed = 0;
+    int w = 0, h = 0, monsters = 0, rooms = 0;
+    if(!in.getVarint(seed, UINT64_MAX) || !in.getVarint(w, MAX_DIMENSION) ||
+       !in.getVarint(h, MAX_DIMENSION) || w < MIN_WIDTH || h < MIN_HEIGHT) {
+        return bad("bad dungeon size");
+    }
+    int cellCount = w * h;
+    if(!in.getVarint(monsters, cellCount) || !in.getVarint(rooms, cellCount)) {
+        return bad("truncated header");
+    }
+
+    struct CellPatch { int idx; uint8_t hard; char c; };
+    int count = 0, last = 0;
+    if(!in.getVarint(count, (int)std::min<size_t>(in.remaining() / 3, cellCount))) {
+        return bad("truncated cell list");
+    }
+    std::vector<CellPatch> cells(count);
+    for(CellPatch &p : cells) {
+        int gap = 0;
+        uint8_t c = 0;
+        if(!in.getVarint(gap, cellCount - 1 - last) || !in.getU8(p.hard) || !in.getU8(c) ||
+           !strchr(" .#<>", c) || c == 0) {
+            return bad("bad cell list");
+        }
+        p.idx = last += gap;
+        p.c = (char)c;
+    }
+
+    struct MonsterPatch { int idx; uint8_t flags; int x, y, hp, seenX, seenY; };
+    last = 0;
+    if(!in.getVarint(count, (int)std::min<size_t>(in.remaining() / 2, monsters))) {
+        return bad("truncated monster list");
+    }
+    std::vector<MonsterPatch> mons(count);
+    for(MonsterPatch &p : mons) {
+        int gap = 0;
+        p = MonsterPatch{ 0, 0, 0, 0, 0, 0, 0 };
+        bool ok = in.getVarint(gap, monsters - 1 - last) && in.getU8(p.flags) && p.flags != 0 &&
+                  p.flags <= (DELTA_DEAD | DELTA_MOVED | DELTA_HP | DELTA_SEEN);
+        if(ok && (p.flags & DELTA_MOVED)) {
+            ok = in.getVarint(p.x, w - 1) && in.getVarint(p.y, h - 1);
+        }
+        if(ok && (p.flags & DELTA_HP)) {
+            ok = in.getVarint(p.hp, INT32_MAX);
+        }
+        if(ok && (p.flags & DELTA_SEEN)) {
+            ok = in.getVarint(p.seenX, w) && in.getVarint(p.seenY, h);
+        }
+        if(!ok) {
+            return bad("bad monster list");
+        }
+        p.idx = last += gap;
+    }
+
+    int pcx = 0, pcy = 0;
+    if(!in.getVarint(pcx, w - 1) || !in.getVarint(pcy, h - 1)) {
+        return bad("PC is off the map");
+    }
+    uint8_t started = 0;
+    int clock = 0, turn_count = 0;
+    std::vector<std::pair<int, int>> turns;
+    if(!in.getU8(started) || started > 1) {
+        return bad("truncated turn queue");
+    }
+    if(started) {
+        if(!in.getVarint(clock, INT32_MAX / 2) ||
+           !in.getVarint(turn_count, (int)std::min<size_t>(in.remaining() / 2, INT32_MAX))) {
+            return bad("truncated turn queue");
+        }
+        turns.resize(turn_count);
+        for(auto &t : turns) {
+            if(!in.getVarint(t.first, monsters) || !in.getVarint(t.second, MAX_TURN_DELAY)) {
+                return bad("truncated turn queue");
+            }
+        }
+    }
+    if(in.remaining() != 0) {
+        return bad("unexpected bytes after the turn queue");
+    }
+
+    std::unique_ptr<Dungeon> g(new Dungeon(w, h));
+    g->roomsWanted = rooms;
+    g->generateFromSeed(seed, monsters);
+    int built = (int)g->npcs.size();
+    if((!mons.empty() && mons.back().idx >= built)) {
+        return bad("monster list doesn't match the rebuilt floor");
+    }
+    for(const CellPatch &p : cells) {
+        int x = p.idx % w, y = p.idx / w;
+        g->setHardness(x, y, p.hard);
+        if(g->base_map[y][x] != p.c) g->setCell(x, y, p.c);
+    }
+    for(const MonsterPatch &p : mons) {
+        NPC &m = g->npcs[p.idx];
+        if(p.flags & DELTA_DEAD) {
+            g->killCharacter(&m);
+            continue;
+        }
+        if(p.flags & DELTA_MOVED) g->moveCharacter(&m, p.x, p.y);
+        if(p.flags & DELTA_HP)    m.hp = p.hp;
+        if(p.flags & DELTA_SEEN) {
+            m.lastPcX = p.seenX - 1;
+            m.lastPcY = p.seenY - 1;
+        }
+    }
+    // The PC is put back by createPC, like after any other load.
+    g->unlinkOccupant(&g->pc);
+    g->pc.alive = false;
+    g->hasPC = false;
+    g->pc_x = pcx;
+    g->pc_y = pcy;
+    g->turnQueue.clear(clock);
+    if(started) {
+        for(auto &t : turns) {
+            if(t.first == PC_HANDLE || (t.first <= built && g->npcs[t.first - 1].alive)) {
+                g->turnQueue.schedule(t.first, clock + t.second);
+            }
+        }
+        for(const NPC &m : g->npcs) {
+            if(m.alive && !g->turnQueue.scheduled(m.handle)) g->turnQueue.schedule(m.handle, clock);
         }
-        attempts--;
+        g->turnsStarted = true;
+    }
+    g->invalidatePaths();
+
+    d.clearCharacters();
+    if(d.width != w || d.height != h) {
+        d.resize(w, h);
     }
-    d.room_count = c;
+    d.swapLevel(*g);
+    return true;
 }
 
-void connectRoomsViaCorridor(Dungeon &d) {
-    if(d.room_count < 2) return;
-    for(int i=1; i<d.room_count; i++){
-        int x1 = d.rooms[i-1].x + d.rooms[i-1].w/2;
-        int y1 = d.rooms[i-1].y + d.rooms[i-1].h/2;
-        int x2 = d.rooms[i].x + d.rooms[i].w/2;
-        int y2 = d.rooms[i].y + d.rooms[i].h/2;
-        while(x1 != x2){
-            if(d.inBounds(x1, y1)){
-                if(d.base_map[y1][x1] != '.') {
-                    d.base_map[y1][x1] = '#';
-                    d.hardness[y1][x1] = 0;
-                }
-            }
-            x1 += (x2 > x1)? 1 : -1;
+// Maps the file and checks all of it (marker, version, file_size against the
+// real length, every count against the bytes left) before touching d, so a
+// bad file leaves the dungeon as it was. Rooms and monsters that fall off the
+// map are skipped as before.
+static bool load_dungeon(Dungeon &d, const char* path) {
+    MappedFile file;
+    if(!file.open(path)) {
+        return false;
+    }
+    auto bad = [path](const char *why) {
+        std::cerr << path << ": " << why << "\n";
+        return false;
+    };
+    ByteReader in(file.data(), file.size());
+
+    const uint8_t *marker = in.take(MARKER_LEN);
+    if(!marker || memcmp(marker, FILE_MARKER, MARKER_LEN) != 0){
+        return bad("invalid marker");
+    }
+    uint32_t version = 0;
+    uint32_t file_size = 0;
+    if(!in.getU32(version) || !in.getU32(file_size)) {
+        return bad("truncated header");
+    }
+    if(version == (uint32_t)FILE_VERSION_COMPACT) {
+        if(file.size() != file_size) {
+            return bad("file_size does not match the file's length");
         }
-        while(y1 != y2){
-            if(d.inBounds(x1, y1)){
-                if(d.base_map[y1][x1] != '.') {
-                    d.base_map[y1][x1] = '#';
-                    d.hardness[y1][x1] = 0;
-                }
+        return load_dungeon_compact(d, in, path);
+    }
+    if(version == (uint32_t)FILE_VERSION_DELTA) {
+        if(file.size() != file_size) {
+            return bad("file_size does not match the file's length");
+        }
+        return load_dungeon_delta(d, in, path);
+    }
+    if(version != (uint32_t)FILE_VERSION && version != (uint32_t)FILE_VERSION_SIZED){
+        return bad("unsupported file version");
+    }
+    bool sized = (version == (uint32_t)FILE_VERSION_SIZED);
+    if(file.size() != file_size && !(!sized && file.size() == (size_t)file_size + 2)) {
+        return bad("file_size does not match the file's length");
+    }
+
+    int w = DEFAULT_WIDTH, h = DEFAULT_HEIGHT;
+    if(sized) {
+        uint16_t fw = 0, fh = 0;
+        if(!in.getU16(fw) || !in.getU16(fh)) {
+            return bad("truncated header");
+        }
+        if(fw < MIN_WIDTH || fh < MIN_HEIGHT || fw > MAX_DIMENSION || fh > MAX_DIMENSION) {
+            return bad("bad dungeon size");
+        }
+        w = fw;
+        h = fh;
+    }
+
+    int pcx = 0, pcy = 0;
+    if(!in.getCoord(pcx, sized) || !in.getCoord(pcy, sized)) {
+        return bad("truncated header");
+    }
+    if(pcx >= w || pcy >= h) {
+        return bad("PC is off the map");
+    }
+
+    const uint8_t *hard = in.take((size_t)w * h);
+    if(!hard) {
+        return bad("truncated hardness map");
+    }
+
+    uint32_t r_count = 0;
+    if(!in.getCount(r_count, sized) || r_count > in.remaining() / (sized ? 8 : 4)) {
+        return bad("truncated room list");
+    }
+    std::vector<Room> rooms;
+    rooms.reserve(r_count);
+    for(uint32_t i=0; i<r_count; i++){
+        Room rm;
+        in.getCoord(rm.x, sized);
+        in.getCoord(rm.y, sized);
+        in.getCoord(rm.w, sized);
+        in.getCoord(rm.h, sized);
+        if(rm.x + rm.w > w || rm.y + rm.h > h) continue;
+        rooms.push_back(rm);
+    }
+
+    int stairs[2][3] = { {0, 0, 0}, {0, 0, 0} };   // count, x, y for up, down
+    for(auto &st : stairs) {
+        uint16_t c = 0;
+        if(!in.getU16(c)) {
+            return bad("truncated stairs");
+        }
+        if(c > 0) {
+            if(!in.getCoord(st[1], sized) || !in.getCoord(st[2], sized)) {
+                return bad("truncated stairs");
             }
-            y1 += (y2 > y1)? 1 : -1;
+            // Play reads the stairs' cells directly, so they must be on the map.
+            if(st[1] >= w || st[2] >= h) {
+                return bad("stairs out of bounds");
+            }
+            st[0] = 1;
+        }
+    }
+
+    uint32_t monster_count = 0;
+    size_t recSize = sized ? 7 : 5;
+    if(!in.getCount(monster_count, sized) || monster_count > in.remaining() / recSize) {
+        return bad("truncated monster list");
+    }
+    const uint8_t *monsters = in.take(monster_count * recSize);
+    if(in.remaining() != 0 && !(!sized && in.remaining() == 2)) {
+        return bad("unexpected bytes after the monster list");
+    }
+
+    // The file is sound; replace the dungeon with it.
+    d.clearCharacters();
+    if(d.width != w || d.height != h) {
+        d.resize(w, h);
+    }
+    d.pc_x = pcx;
+    d.pc_y = pcy;
+    for(int r=0; r<h; r++){
+        for(int c=0; c<w; c++){
+            uint8_t hh = hard[(size_t)r*w + c];
+            d.setHardness(c, r, hh);
+            d.base_map[r][c] = hh == 0 ? '#' : ' ';
+        }
+    }
+    d.rooms = std::move(rooms);
+    for(const Room &rm : d.rooms){
+        for(int row = rm.y; row < rm.y + rm.h; row++){
+            std::fill_n(&d.base_map[row][rm.x], rm.w, '.');
+        }
+    }
+    d.upCount = stairs[0][0];
+    d.up_xCoord = stairs[0][1];
+    d.up_yCoord = stairs[0][2];
+    d.downCount = stairs[1][0];
+    d.down_xCoord = stairs[1][1];
+    d.down_yCoord = stairs[1][2];
+    if(d.upCount>0) {
+        d.base_map[d.up_yCoord][d.up_xCoord] = '<';
+    }
+    if(d.downCount>0) {
+        d.base_map[d.down_yCoord][d.down_xCoord] = '>';
+    }
+    d.invalidatePaths();
+    d.terrainReplaced();
+
+    ByteReader mon(monsters, monster_count * recSize);
+    d.npcs.reserve(monster_count);
+    for(uint32_t i=0; i<monster_count; i++){
+        int mx = 0, my = 0;
+        uint8_t mspeed = 0, mhp = 0, mbtype = 0;
+        mon.getCoord(mx, sized);
+        mon.getCoord(my, sized);
+        mon.getU8(mspeed);
+        mon.getU8(mhp);
+        mon.getU8(mbtype);
+        // A speed of 0 would divide by zero in the event loop.
+        if(!d.inBounds(mx, my) || mspeed == 0) continue;
+        d.addMonster(NPC(mbtype, mx, my, mspeed, mhp));
+    }
+    return true;
+}
+
+static const char *FLOOR_MARKER = "RLG327-FLOOR";
+
+// Runs of one byte, as (byte, u16 length) pairs. Base and remembered maps
+// are mostly long runs of rock or unseen cells.
+static void putRuns(ByteWriter &out, const Grid<char> &g) {
+    for(int y=0; y<g.height(); y++){
+        const char *row = g[y];
+        for(int x=0; x<g.width(); ){
+            int n = 1;
+            while(x + n < g.width() && row[x + n] == row[x] && n < 65535) n++;
+            out.putU8((uint8_t)row[x]);
+            out.putU16((uint16_t)n);
+            x += n;
         }
     }
 }
 
-void placeStairs(Dungeon &d) {
-    bool upFlag = false;
-    bool downFlag = false;
-    while(!upFlag || !downFlag) {
-        int up_x = rand()%WIDTH;
-        int up_y = rand()%HEIGHT;
-        int down_x = rand()%WIDTH;
-        int down_y = rand()%HEIGHT;
-        if(!upFlag) {
-            if((d.base_map[up_y][up_x] == '.' || d.base_map[up_y][up_x] == '#')) {
-                d.base_map[up_y][up_x] = '<';
-                d.up_xCoord = up_x;
-                d.up_yCoord = up_y;
-                d.upCount = 1;
-                upFlag = true;
-            }
-        }
-        if(!downFlag) {
-            if((d.base_map[down_y][down_x] == '.' || d.base_map[down_y][down_x] == '#')
-               && !(up_x == down_x && up_y == down_y)){
-                d.base_map[down_y][down_x] = '>';
-                d.down_xCoord = down_x;
-                d.down_yCoord = down_y;
-                d.downCount = 1;
-                downFlag = true;
-            }
+static bool getRuns(ByteReader &in, Grid<char> &g) {
+    for(int y=0; y<g.height(); y++){
+        char *row = g[y];
+        for(int x=0; x<g.width(); ){
+            uint8_t c;
+            uint16_t n;
+            if(!in.getU8(c) || !in.getU16(n) || n == 0 || n > g.width() - x) return false;
+            std::fill_n(row + x, n, (char)c);
+            x += n;
         }
     }
+    return true;
 }
 
-static void checkDir() {
-    char* home = getenv("HOME");
-    if(!home){
-        std::cerr << "ERROR: No HOME env var." << std::endl;
-        exit(1);
+static void putCharacter(ByteWriter &out, const Character &c) {
+    out.putU16((uint16_t)c.x);
+    out.putU16((uint16_t)c.y);
+    out.putU8((uint8_t)c.speed);
+    out.putU16((uint16_t)c.hp);
+    out.putU8(c.btype);
+    out.putU8(c.alive);
+    out.putU32((uint32_t)(c.prevHere + 1));
+    out.putU32((uint32_t)(c.nextHere + 1));
+}
+
+static bool getCharacter(ByteReader &in, Character &c, int w, int h, int handles) {
+    uint16_t x, y, hp;
+    uint8_t speed, btype, alive;
+    uint32_t prev, next;
+    if(!in.getU16(x) || !in.getU16(y) || !in.getU8(speed) || !in.getU16(hp) ||
+       !in.getU8(btype) || !in.getU8(alive) || !in.getU32(prev) || !in.getU32(next)) {
+        return false;
     }
-    char path[1024];
-    snprintf(path,sizeof(path), "%s%s", home, DUNGEON_DIR);
-    if(mkdir(path,0700) && errno != EEXIST) {
-        std::cerr << "ERROR creating " << path << ": " << strerror(errno) << std::endl;
-        exit(1);
+    if(x >= w || y >= h || speed == 0 || prev > (uint32_t)handles || next > (uint32_t)handles) {
+        return false;
     }
+    c.x = x;
+    c.y = y;
+    c.speed = speed;
+    c.hp = hp;
+    c.btype = btype;
+    c.alive = alive != 0;
+    c.prevHere = (CharHandle)prev - 1;
+    c.nextHere = (CharHandle)next - 1;
+    return true;
 }
 
-static void getPath(char* buf, size_t size) {
-    char* home = getenv("HOME");
-    snprintf(buf,size, "%s%s%s", home, DUNGEON_DIR, DUNGEON_FILE);
+// Everything about a floor that play can change, so a restored floor plays
+// on exactly as if it had stayed in memory: hardness, base map, rooms,
+// stairs, the PC with its remembered map, and every monster with its place
+// in its cell's list and where it last saw the PC, the turns still to come
+// and what the floor was built from. Distance maps are left out and
+// recomputed by readFloorSnapshot.
+static bool writeFloorSnapshot(const Dungeon &d, const char *path) {
+    ByteWriter out;
+    out.buf.reserve((size_t)d.width * d.height + 1024);
+    out.putBytes(FLOOR_MARKER, MARKER_LEN);
+    out.putU16((uint16_t)d.width);
+    out.putU16((uint16_t)d.height);
+    for(int r=0; r<d.height; r++){
+        out.putBytes(d.hardness[r], d.width);
+    }
+    putRuns(out, d.base_map);
+    out.putU32((uint32_t)d.rooms.size());
+    for(const Room &rm : d.rooms){
+        out.putU16((uint16_t)rm.x);
+        out.putU16((uint16_t)rm.y);
+        out.putU16((uint16_t)rm.w);
+        out.putU16((uint16_t)rm.h);
+    }
+    out.putU8((uint8_t)d.upCount);
+    out.putU16((uint16_t)d.up_xCoord);
+    out.putU16((uint16_t)d.up_yCoord);
+    out.putU8((uint8_t)d.downCount);
+    out.putU16((uint16_t)d.down_xCoord);
+    out.putU16((uint16_t)d.down_yCoord);
+    putCharacter(out, d.pc);
+    out.putU8(d.pc.noFog);
+    putRuns(out, d.pc.remembered_map);
+    out.putU32((uint32_t)d.npcs.size());
+    for(const NPC &m : d.npcs){
+        putCharacter(out, m);
+        out.putU16((uint16_t)(m.lastPcX + 1));
+        out.putU16((uint16_t)(m.lastPcY + 1));
+    }
+    // Pending turns in the order they will run, as offsets from the clock
+    out.putU8(d.turnsStarted);
+    out.putU32((uint32_t)d.turnQueue.now());
+    out.putU32((uint32_t)d.turnQueue.size());
+    int now = d.turnQueue.now();
+    d.turnQueue.forEach([&out, now](CharHandle who, int time) {
+        out.putU32((uint32_t)who);
+        out.putU16((uint16_t)(time - now));
+    });
+    out.putU8(d.origin.known);
+    out.putU64(d.origin.seed);
+    out.putU32((uint32_t)d.origin.monsters);
+    out.putU32((uint32_t)d.origin.rooms);
+    return writeFileAtomic(path, out.buf);
 }
 
-static void save_dungeon(Dungeon &d, const char* path) {
-    FILE *f = fopen(path, "wb");
-    if(!f) {
-        std::cerr << "Error opening " << path << " for write\n";
-        return;
+// Replaces d's floor with the snapshot, or leaves it alone and returns false
+// if the file is unreadable.
+static bool readFloorSnapshot(Dungeon &d, const char *path) {
+    MappedFile file;
+    if(!file.open(path)) {
+        return false;
+    }
+    ByteReader in(file.data(), file.size());
+    const uint8_t *marker = in.take(MARKER_LEN);
+    uint16_t w = 0, h = 0;
+    if(!marker || memcmp(marker, FLOOR_MARKER, MARKER_LEN) != 0 || !in.getU16(w) ||
+       !in.getU16(h) || w != d.width || h != d.height) {
+        std::cerr << path << " is not a snapshot of this dungeon\n";
+        return false;
+    }
+    const uint8_t *hard = in.take((size_t)w * h);
+    Grid<char> base;
+    base.assign(w, h, ' ');
+    uint32_t roomCount = 0;
+    bool ok = hard && getRuns(in, base) && in.getU32(roomCount) &&
+              roomCount <= in.remaining() / 8;
+    std::vector<Room> rooms(ok ? roomCount : 0);
+    for(Room &rm : rooms){
+        uint16_t v[4];
+        for(uint16_t &c : v) in.getU16(c);
+        rm = Room{ v[0], v[1], v[2], v[3] };
+    }
+    uint8_t up = 0, down = 0, noFog = 0;
+    uint16_t stairs[4] = { 0, 0, 0, 0 };
+    ok = ok && in.getU8(up) && in.getU16(stairs[0]) && in.getU16(stairs[1]) &&
+         in.getU8(down) && in.getU16(stairs[2]) && in.getU16(stairs[3]);
+    PC pc(w, h);
+    uint32_t npcCount = 0;
+    ok = ok && getCharacter(in, pc, w, h, std::numeric_limits<int>::max()) && in.getU8(noFog) &&
+         getRuns(in, pc.remembered_map) && in.getU32(npcCount) && npcCount <= in.remaining() / 21;
+    // Links are checked against the final handle count once it is known.
+    std::vector<NPC> npcs;
+    npcs.reserve(ok ? npcCount : 0);
+    for(uint32_t i=0; ok && i<npcCount; i++){
+        NPC m(0, 0, 0, 10, 10);
+        uint16_t seenX = 0, seenY = 0;
+        ok = getCharacter(in, m, w, h, (int)npcCount + 1) && in.getU16(seenX) &&
+             in.getU16(seenY) && seenX <= w && seenY <= h;
+        m.lastPcX = (int)seenX - 1;
+        m.lastPcY = (int)seenY - 1;
+        m.symbol = "0123456789abcdef"[m.btype & 0x0F];
+        m.handle = (CharHandle)i + 1;
+        npcs.push_back(m);
+    }
+    uint8_t started = 0;
+    uint32_t clock = 0, pending = 0;
+    ok = ok && in.getU8(started) && in.getU32(clock) && clock <= INT32_MAX / 2 &&
+         in.getU32(pending) && pending <= in.remaining() / 6;
+    std::vector<Event> turns(ok ? pending : 0);
+    for(Event &e : turns) {
+        uint32_t who = 0;
+        uint16_t delay = 0;
+        ok = ok && in.getU32(who) && in.getU16(delay) && who <= npcCount &&
+             delay <= MAX_TURN_DELAY;
+        e = Event{ (int)(clock + delay), (CharHandle)who };
+    }
+    Dungeon::FloorOrigin origin;
+    uint8_t known = 0;
+    uint32_t originMonsters = 0, originRooms = 0;
+    ok = ok && in.getU8(known) && in.getU64(origin.seed) && in.getU32(originMonsters) &&
+         in.getU32(originRooms);
+    origin.known = known != 0;
+    origin.monsters = (int)originMonsters;
+    origin.rooms = (int)originRooms;
+    if(!ok || pc.prevHere > (CharHandle)npcCount || pc.nextHere > (CharHandle)npcCount) {
+        std::cerr << path << " is truncated or corrupt\n";
+        return false;
     }
-    fwrite(FILE_MARKER,1,MARKER_LEN,f);
-    uint32_t version_be = htobe32(FILE_VERSION);
-    fwrite(&version_be, sizeof(version_be), 1, f);
 
-    uint16_t up_stairs_count = d.upCount>0 ? 1 : 0;
-    uint16_t down_stairs_count = d.downCount>0 ? 1 : 0;
-    uint16_t alive_monsters = 0;
-    for(auto c : d.characters){
-        if(c->type == Character::NPC_TYPE && c->alive) {
-            alive_monsters++;
+    d.clearCharacters();
+    for(int r=0; r<h; r++){
+        for(int c=0; c<w; c++){
+            d.setHardness(c, r, hard[(size_t)r*w + c]);
+        }
+    }
+    std::swap(d.base_map, base);
+    d.rooms = std::move(rooms);
+    d.upCount = up;
+    d.up_xCoord = stairs[0];
+    d.up_yCoord = stairs[1];
+    d.downCount = down;
+    d.down_xCoord = stairs[2];
+    d.down_yCoord = stairs[3];
+    pc.handle = PC_HANDLE;
+    pc.noFog = noFog != 0;
+    d.pc = std::move(pc);
+    d.hasPC = true;
+    d.pc_is_alive = d.pc.alive;
+    d.pc_x = d.pc.x;
+    d.pc_y = d.pc.y;
+    d.npcs = std::move(npcs);
+    // Each cell's list starts at the live character with nothing before it.
+    auto head = [&d](Character &c) {
+        if(c.alive && c.prevHere == NO_CHAR) d.occupants[c.y][c.x] = c.handle;
+    };
+    head(d.pc);
+    for(NPC &m : d.npcs) {
+        head(m);
+        if(m.alive) d.liveMonsters++;
+    }
+    d.turnQueue.clear((int)clock);
+    for(const Event &e : turns) {
+        d.turnQueue.schedule(e.who, e.time);
+    }
+    d.turnsStarted = started != 0;
+    d.terrainReplaced();
+    d.origin = origin;
+    // Not in the snapshot; rebuilt here so a floor read back from disk
+    // comes out the same as one swapped back from memory.
+    d.recomputeDistanceMaps(d.pc_x, d.pc_y);
+    return true;
+}
+
+// Floors the PC has left, by depth. The most recently left stay in memory
+// as whole Dungeon objects, so going back is a swap; once those take more
+// than `budget` bytes, the least recently left are written to snapshot
+// files in `dir` and read back when the PC returns.
+class FloorStack {
+public:
+    FloorStack(int w, int h, size_t budget, const std::string &dir)
+        : w(w), h(h), budget(budget), dir(dir), clock(0), resident(0) {}
+
+    ~FloorStack() {
+        for(auto &f : floors) {
+            if(!f.second.level) unlink(spillPath(f.first).c_str());
         }
     }
 
-    uint32_t file_size = 1702 + (d.room_count*4) + 2 + (up_stairs_count*2) + 2 + (down_stairs_count*2);
-    file_size += 2 + alive_monsters*5;
-    uint32_t file_size_be = htobe32(file_size);
-    fwrite(&file_size_be, sizeof(file_size_be), 1, f);
+    FloorStack(const FloorStack &) = delete;
+    FloorStack &operator=(const FloorStack &) = delete;
+
+    bool has(int depth) const {
+        return floors.count(depth) != 0;
+    }
 
-    uint8_t pcx = (uint8_t)d.pc_x;
-    uint8_t pcy = (uint8_t)d.pc_y;
-    fwrite(&pcx,1,1,f);
-    fwrite(&pcy,1,1,f);
+    // Moves d's floor into the stack as `depth`.
+    void stash(Dungeon &d, int depth) {
+        std::unique_ptr<Dungeon> slot = std::move(spare);
+        if(!slot) slot.reset(new Dungeon(w, h));
+        slot->swapLevel(d);
+        Entry &e = floors[depth];
+        e.bytes = levelBytes(*slot);
+        e.used = ++clock;
+        e.level = std::move(slot);
+        resident += e.bytes;
+        while(resident > budget && spillOldest()) {}
+    }
 
-    for(int r=0; r<HEIGHT; r++){
-        for(int c=0; c<WIDTH; c++){
-            uint8_t hh = (uint8_t)d.hardness[r][c];
-            fwrite(&hh,1,1,f);
+    // Moves floor `depth` into d, or returns false if it was never left (or
+    // its snapshot can't be read back).
+    bool restore(Dungeon &d, int depth) {
+        auto it = floors.find(depth);
+        if(it == floors.end()) return false;
+        bool ok = true;
+        if(it->second.level) {
+            d.swapLevel(*it->second.level);
+            resident -= it->second.bytes;
+            spare = std::move(it->second.level);
+        } else {
+            std::string path = spillPath(depth);
+            ok = readFloorSnapshot(d, path.c_str());
+            unlink(path.c_str());
         }
+        floors.erase(it);
+        return ok;
     }
 
-    uint16_t r_be = htobe16(d.room_count);
-    fwrite(&r_be, sizeof(r_be), 1, f);
-    for(int i=0; i<d.room_count; i++){
-        uint8_t rx = (uint8_t)d.rooms[i].x;
-        uint8_t ry = (uint8_t)d.rooms[i].y;
-        uint8_t rw = (uint8_t)d.rooms[i].w;
-        uint8_t rh = (uint8_t)d.rooms[i].h;
-        fwrite(&rx,1,1,f);
-        fwrite(&ry,1,1,f);
-        fwrite(&rw,1,1,f);
-        fwrite(&rh,1,1,f);
+private:
+    struct Entry {
+        std::unique_ptr<Dungeon> level;   // null once spilled
+        size_t                   bytes;
+        unsigned long            used;
+    };
+
+    int                      w, h;
+    size_t                   budget;
+    std::string              dir;
+    unsigned long            clock;
+    size_t                   resident;
+    std::map<int, Entry>     floors;
+    // The last restored floor's Dungeon, kept for the next stash
+    std::unique_ptr<Dungeon> spare;
+
+    std::string spillPath(int depth) const {
+        return dir + "/floor-" + std::to_string(getpid()) + "-" + std::to_string(depth);
     }
 
-    uint16_t up_be = htobe16(up_stairs_count);
-    fwrite(&up_be, sizeof(up_be), 1, f);
-    if(up_stairs_count==1){
-        uint8_t sx=(uint8_t)d.up_xCoord, sy=(uint8_t)d.up_yCoord;
-        fwrite(&sx,1,1,f);
-        fwrite(&sy,1,1,f);
+    // The per-cell grids, the PC's map, the cell lists, the monster pool and
+    // the turn queue
+    static size_t levelBytes(const Dungeon &d) {
+        size_t cells = (size_t)d.hardness.cellCount();
+        size_t perCell = sizeof(uint8_t) * 2 + sizeof(char) * 2 + sizeof(CharHandle) +
+                         sizeof(uint16_t) * 2;
+        size_t lists = d.roomCells.capacity() + d.corridorCells.capacity() +
+                       d.cellSlot.capacity() + d.passableCells.capacity();
+        return cells * perCell + cells / 8 + lists * sizeof(int32_t) +
+               d.npcs.capacity() * sizeof(NPC) + d.rooms.capacity() * sizeof(Room) +
+               d.turnQueue.memoryBytes();
+    }
+
+    // Writes the least recently left in-memory floor to disk and frees it.
+    bool spillOldest() {
+        Entry *oldest = nullptr;
+        int oldestDepth = 0;
+        for(auto &f : floors) {
+            if(f.second.level && (!oldest || f.second.used < oldest->used)) {
+                oldest = &f.second;
+                oldestDepth = f.first;
+            }
+        }
+        if(!oldest) return false;
+        resident -= oldest->bytes;
+        if(writeFloorSnapshot(*oldest->level, spillPath(oldestDepth).c_str())) {
+            oldest->level.reset();
+        } else {
+            // Can't spill it, so forget it; it will be generated afresh.
+            floors.erase(oldestDepth);
+        }
+        return true;
+    }
+};
+
+void Dungeon::enterFloor(int to, int nummon) {
+    int dir = to > depth ? 1 : -1;
+    if(floorStack) {
+        floorStack->stash(*this, depth);
+    }
+    if(floorStack && floorStack->restore(*this, to)) {
+        placeArrival(dir);
+    } else {
+        uint64_t fs = floorSeed(seed, to);
+        if(!prefetch || !prefetch->take(*this, fs, nummon)) {
+            // Same stream the prefetcher would have used; play carries on
+            // from where it was.
+            Rng play = rng;
+            generateFromSeed(fs, nummon);
+            rng = play;
+            recomputeDistanceMaps(pc_x, pc_y);
+        }
+    }
+    depth = to;
+    if(prefetch && !(floorStack && floorStack->has(depth + 1))) {
+        prefetch->start(floorSeed(seed, depth + 1), nummon, roomsWanted);
     }
-    uint16_t down_be = htobe16(down_stairs_count);
-    fwrite(&down_be, sizeof(down_be), 1, f);
-    if(down_stairs_count==1){
-        uint8_t sx=(uint8_t)d.down_xCoord, sy=(uint8_t)d.down_yCoord;
-        fwrite(&sx,1,1,f);
-        fwrite(&sy,1,1,f);
-    }
-    uint16_t am_be = htobe16(alive_monsters);
-    fwrite(&am_be, sizeof(am_be), 1, f);
-    for(auto c : d.characters){
-        if(c->type == Character::NPC_TYPE && c->alive){
-            uint8_t mx = (uint8_t)c->x;
-            uint8_t my = (uint8_t)c->y;
-            uint8_t mspeed = (uint8_t)c->speed;
-            uint8_t mhp = (uint8_t)c->hp;
-            uint8_t mbtype = (uint8_t)c->btype;
-            fwrite(&mx,1,1,f);
-            fwrite(&my,1,1,f);
-            fwrite(&mspeed,1,1,f);
-            fwrite(&mhp,1,1,f);
-            fwrite(&mbtype,1,1,f);
-        }
-    }
-
-    fclose(f);
 }
 
-static void load_dungeon(Dungeon &d, const char* path) {
-    FILE *f = fopen(path,"rb");
-    if(!f){
-        std::cerr << "Error opening " << path << " for read\n";
-        return;
-    }
-    char marker[MARKER_LEN+1];
-    fread(marker,1,MARKER_LEN,f);
-    marker[MARKER_LEN]='\0';
-    if(strcmp(marker, FILE_MARKER)!=0){
-        std::cerr << "Invalid marker in file\n";
-        fclose(f);
-        return;
-    }
-    uint32_t version;
-    fread(&version,sizeof(version),1,f);
-    version = be32toh(version);
-    if(version != FILE_VERSION){
-        std::cerr << "Unsupported file version\n";
-        fclose(f);
-        return;
+void Dungeon::enablePrefetch() {
+    if(!prefetch) {
+        prefetch.reset(new LevelPrefetch(width, height));
     }
-    uint32_t file_size;
-    fread(&file_size, sizeof(file_size),1,f);
-    file_size = be32toh(file_size);
+    prefetch->start(floorSeed(seed, depth + 1), global_num_monsters, roomsWanted);
+}
 
-    uint8_t pcx, pcy;
-    fread(&pcx,1,1,f);
-    fread(&pcy,1,1,f);
-    d.pc_x = pcx;
-    d.pc_y = pcy;
+void Dungeon::enableFloorStack(size_t budget, const std::string &dir) {
+    floorStack.reset(new FloorStack(width, height, budget, dir));
+}
+
+// --record / --replay. A session is fully determined by its seed, its
+// options and the keys the PC was given, so that is all the log holds: a
+// header, then one byte per key (0xff escapes the rare key above 254, such
+// as a curses KEY_ code, to 0xff + four bytes). The state hash at the end
+// lets a replay confirm it really did end up in the same place.
+static const char *REPLAY_MARKER = "RLG327-KEYS3";
+// Logs from before --rooms have no room count, and ones from before --lod
+// no LOD distance.
+static const char *REPLAY_MARKER_V1 = "RLG327-KEYS1";
+static const char *REPLAY_MARKER_V2 = "RLG327-KEYS2";
+
+static const uint8_t SESSION_LOADED   = 0x1;  // started from --load
+static const uint8_t SESSION_HEADLESS = 0x2;  // ran through runHeadless
+
+struct SessionLog {
+    uint64_t         seed;
+    int              width, height;
+    uint32_t         nummon;
+    uint32_t         rooms;
+    uint32_t         lod;
+    uint8_t          flags;
+    int32_t          floors;   // headless only
+    int64_t          turns;    // headless only, -1 = no limit
+    uint64_t         finalHash;
+    std::vector<int> keys;
+};
+
+static bool saveSession(const SessionLog &s, const char *path) {
+    ByteWriter out;
+    out.putBytes(REPLAY_MARKER, MARKER_LEN);
+    out.putU64(s.seed);
+    out.putU16((uint16_t)s.width);
+    out.putU16((uint16_t)s.height);
+    out.putU32(s.nummon);
+    out.putU32(s.rooms);
+    out.putU32(s.lod);
+    out.putU8(s.flags);
+    out.putU32((uint32_t)s.floors);
+    out.putU64((uint64_t)s.turns);
+    out.putU64(s.finalHash);
+    out.putU32((uint32_t)s.keys.size());
+    for(int key : s.keys) {
+        if(key >= 0 && key < 0xff) {
+            out.putU8((uint8_t)key);
+        } else {
+            out.putU8(0xff);
+            out.putU32((uint32_t)key);
+        }
+    }
+    return writeFileAtomic(path, out.buf);
+}
+
+static bool loadSession(SessionLog &s, const char *path) {
+    MappedFile file;
+    if(!file.open(path)) {
+        return false;
+    }
+    ByteReader in(file.data(), file.size());
+    const uint8_t *marker = in.take(MARKER_LEN);
+    bool v1 = marker && memcmp(marker, REPLAY_MARKER_V1, MARKER_LEN) == 0;
+    bool v2 = marker && memcmp(marker, REPLAY_MARKER_V2, MARKER_LEN) == 0;
+    if(!marker || (!v1 && !v2 && memcmp(marker, REPLAY_MARKER, MARKER_LEN) != 0)) {
+        std::cerr << path << " is not a session log\n";
+        return false;
+    }
+    s.rooms = 0;
+    s.lod = 0;
+    uint16_t w = 0, h = 0;
+    uint32_t floors = 0, count = 0;
+    uint64_t turns = 0;
+    bool ok = in.getU64(s.seed) && in.getU16(w) && in.getU16(h) && in.getU32(s.nummon) &&
+              (v1 || in.getU32(s.rooms)) && (v1 || v2 || in.getU32(s.lod)) &&
+              s.lod <= INT32_MAX && in.getU8(s.flags) && in.getU32(floors) &&
+              in.getU64(turns) && in.getU64(s.finalHash) && in.getU32(count);
+    s.width = w;
+    s.height = h;
+    s.floors = (int32_t)floors;
+    s.turns = (int64_t)turns;
+    s.keys.clear();
+    // every key takes at least a byte, which caps a lying count
+    if(ok && count <= in.remaining()) s.keys.reserve(count);
+    for(uint32_t i=0; ok && i<count; i++){
+        uint8_t b;
+        uint32_t wide;
+        if(!in.getU8(b)) {
+            ok = false;
+        } else if(b != 0xff) {
+            s.keys.push_back(b);
+        } else if(in.getU32(wide)) {
+            s.keys.push_back((int)wide);
+        } else {
+            ok = false;
+        }
+    }
+    if(!ok) std::cerr << path << " is truncated\n";
+    return ok;
+}
+
+// --batch: count dungeons with seeds seed, seed+1, ... generated on
+// `threads` workers and saved as RLG327 files (version 2 with --compact, 3
+// with --delta) named by seed in dir. Each
+// worker keeps one Dungeon and reseeds it per file, so every file is the
+// same as `--seed S --save` would write, whatever the thread count.
+static int runBatch(uint64_t seed, long count, int threads, int w, int h,
+                    int nummon, int rooms, SaveFormat format, const std::string &dir) {
+    if(mkdir(dir.c_str(), 0700) && errno != EEXIST) {
+        std::cerr << "ERROR creating " << dir << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    std::atomic<long> next(0);
+    std::atomic<long> failed(0);
+    auto start = std::chrono::steady_clock::now();
+    {
+        WorkerPool pool(threads);
+        for(int t=0; t<threads; t++){
+            pool.submit([&]{
+                Dungeon d(w, h);
+                d.roomsWanted = rooms;
+                for(long i = next++; i < count; i = next++) {
+                    uint64_t s = seed + (uint64_t)i;
+                    d.reseed(s);
+                    d.generateFromSeed(s, nummon);
+                    std::string path = dir + "/dungeon-" + std::to_string(s);
+                    if(!save_dungeon(d, path.c_str(), format)) failed++;
+                }
+            });
+        }
+        pool.wait();
+    }
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    long written = count - failed.load();
+    printf("batch %ld dungeons  %dx%d  seeds %llu..%llu  %d threads  -> %s\n", written, w, h,
+           (unsigned long long)seed, (unsigned long long)(seed + count - 1), threads, dir.c_str());
+    printf("%.3f s  %.0f dungeons/sec\n", secs.count(),
+           secs.count() > 0 ? written / secs.count() : 0.0);
+    return failed.load() ? 1 : 0;
+}
+
+// Random hardness with rectangular rooms joined by L-shaped corridors, like
+// the real generator but for any size.
+static void makeBenchGrid(Dungeon &d) {
+    int w = d.width, h = d.height;
+    d.fillRock();
+    int rooms = std::max(6, (w*h)/400);
+    int px = -1, py = -1;
+    for(int i=0; i<rooms; i++){
+        int rw = d.rng.below(6)+4;
+        int rh = d.rng.below(4)+3;
+        int rx = d.rng.below(w - rw - 2)+1;
+        int ry = d.rng.below(h - rh - 2)+1;
+        for(int y=ry; y<ry+rh; y++){
+            for(int x=rx; x<rx+rw; x++) d.setHardness(x, y, 0);
+        }
+        int cx = rx + rw/2, cy = ry + rh/2;
+        if(px >= 0) {
+            for(int x=std::min(px,cx); x<=std::max(px,cx); x++) d.setHardness(x, py, 0);
+            for(int y=std::min(py,cy); y<=std::max(py,cy); y++) d.setHardness(cx, y, 0);
+        }
+        px = cx;
+        py = cy;
+    }
+}
+
+template <class Queue>
+static double timePasses(DistanceMap &m, Queue &q, int sx, int sy, int reps) {
+    auto start = std::chrono::steady_clock::now();
+    for(int i=0; i<reps; i++){
+        m.recomputeWith(q, sx, sy);
+    }
+    std::chrono::duration<double, std::micro> us = std::chrono::steady_clock::now() - start;
+    return us.count() / reps;
+}
 
-    for(int r=0; r<HEIGHT; r++){
-        for(int c=0; c<WIDTH; c++){
-            uint8_t h;
-            fread(&h,1,1,f);
-            d.hardness[r][c] = h;
-        }
-    }
-    uint16_t r_count;
-    fread(&r_count, sizeof(r_count),1,f);
-    r_count = be16toh(r_count);
-    d.room_count = 0;
-    for(int i=0; i<r_count && i<MAX_ROOMS; i++){
-        uint8_t rx, ry, rw, rh;
-        fread(&rx,1,1,f);
-        fread(&ry,1,1,f);
-        fread(&rw,1,1,f);
-        fread(&rh,1,1,f);
-        d.rooms[i].x = rx; d.rooms[i].y = ry;
-        d.rooms[i].w = rw; d.rooms[i].h = rh;
-        d.room_count++;
-    }
-
-    uint16_t up_c;
-    fread(&up_c, sizeof(up_c),1,f);
-    up_c = be16toh(up_c);
-    d.upCount = 0;
-    if(up_c>0){
-        uint8_t sx, sy;
-        fread(&sx,1,1,f);
-        fread(&sy,1,1,f);
-        d.upCount=1; d.up_xCoord=sx; d.up_yCoord=sy;
-    }
-
-    uint16_t down_c;
-    fread(&down_c, sizeof(down_c),1,f);
-    down_c = be16toh(down_c);
-    d.downCount=0;
-    if(down_c>0){
-        uint8_t sx, sy;
-        fread(&sx,1,1,f);
-        fread(&sy,1,1,f);
-        d.downCount=1; d.down_xCoord=sx; d.down_yCoord=sy;
-    }
-    for(int yy=0; yy<HEIGHT; yy++){
-        for(int xx=0; xx<WIDTH; xx++){
-            if(d.hardness[yy][xx] == 255) {
-                d.base_map[yy][xx] = ' ';
-            } else if(d.hardness[yy][xx] > 0) {
-                d.base_map[yy][xx] = ' ';
+// --bench paths: NodeHeap vs the bucket queue (tunneling) and BFS
+// (non-tunneling) on the same grids, in microseconds per full pass.
+static void benchPaths() {
+    static const int sizes[][2] = { {80, 21}, {256, 256}, {1024, 1024} };
+    printf("%-11s %-13s %12s %12s %8s\n", "size", "map", "NodeHeap us", "new us", "speedup");
+    for(auto &sz : sizes) {
+        int w = sz[0], h = sz[1];
+        int reps = std::max(3, 2000000 / (w*h));
+        Dungeon bench(w, h);
+        bench.reseed(327);
+        makeBenchGrid(bench);
+        int sx = 1, sy = 1;
+        for(int i=0; i<w*h; i++){
+            if(bench.hardness[i / w][i % w] == 0) { sx = i % w; sy = i / w; break; }
+        }
+        Grid<uint16_t> a, b;
+        a.assign(w, h, DIST_INF);
+        b.assign(w, h, DIST_INF);
+        const char *names[] = { "non-tunnel", "tunnel" };
+        for(int k=0; k<2; k++){
+            DistanceMap::Kind kind = k ? DistanceMap::TUNNELING : DistanceMap::NON_TUNNELING;
+            DistanceMap ref(kind, &bench.hardness, &bench.open, &a);
+            DistanceMap fast(kind, &bench.hardness, &bench.open, &b);
+            NodeHeap heap;
+            double tHeap = timePasses(ref, heap, sx, sy, reps);
+            double tFast;
+            if(kind == DistanceMap::NON_TUNNELING) {
+                NodeQueue fifo;
+                tFast = timePasses(fast, fifo, sx, sy, reps);
             } else {
-                d.base_map[yy][xx] = '#';
+                BucketQueue buckets;
+                tFast = timePasses(fast, buckets, sx, sy, reps);
             }
+            char label[32];
+            snprintf(label, sizeof(label), "%dx%d", w, h);
+            printf("%-11s %-13s %12.1f %12.1f %7.2fx%s\n", label, names[k], tHeap, tFast,
+                   tHeap / tFast,
+                   memcmp(a.data(), b.data(), a.cellCount() * sizeof(uint16_t)) ? "  MISMATCH" : "");
         }
     }
-    for(int i=0; i<d.room_count; i++){
-        for(int row = d.rooms[i].y; row < d.rooms[i].y + d.rooms[i].h; row++){
-            for(int col = d.rooms[i].x; col < d.rooms[i].x + d.rooms[i].w; col++){
-                d.base_map[row][col] = '.';
+}
+
+// Second half of --bench paths: a random walk of one-cell source moves,
+// each applied with update() to one map and a full recompute() to another,
+// hops included, in microseconds per step. The two must end up identical.
+static void benchSourceSteps() {
+    static const int sizes[][2] = { {80, 21}, {256, 256}, {1024, 1024} };
+    printf("\n%-11s %-13s %12s %12s %8s\n", "size", "map", "full us", "step us", "speedup");
+    for(auto &sz : sizes) {
+        int w = sz[0], h = sz[1];
+        int steps = std::max(20, 4000000 / (w*h));
+        Dungeon bench(w, h);
+        bench.reseed(327);
+        makeBenchGrid(bench);
+        std::vector<std::pair<int,int>> walk;
+        int x = 1, y = 1;
+        for(int i=0; i<w*h; i++){
+            if(bench.hardness[i / w][i % w] == 0) { x = i % w; y = i / w; break; }
+        }
+        walk.push_back({x, y});
+        while((int)walk.size() <= steps) {
+            int d = bench.rng.below(8);
+            int nx = x + HOP_DX[d], ny = y + HOP_DY[d];
+            if(!bench.inBounds(nx, ny) || bench.hardness[ny][nx] != 0) continue;
+            x = nx;
+            y = ny;
+            walk.push_back({x, y});
+        }
+        Grid<uint16_t> da, db;
+        Grid<uint8_t> ha, hb;
+        da.assign(w, h, DIST_INF);
+        db.assign(w, h, DIST_INF);
+        ha.assign(w, h, HOP_STAY);
+        hb.assign(w, h, HOP_STAY);
+        const char *names[] = { "non-tunnel", "tunnel" };
+        for(int k=0; k<2; k++){
+            DistanceMap::Kind kind = k ? DistanceMap::TUNNELING : DistanceMap::NON_TUNNELING;
+            DistanceMap full(kind, &bench.hardness, &bench.open, &da, &ha);
+            DistanceMap inc(kind, &bench.hardness, &bench.open, &db, &hb);
+            inc.recompute(walk[0].first, walk[0].second);
+            // Interleaved so both see the same cache and clock state
+            std::chrono::duration<double, std::micro> tFull(0), tStep(0);
+            for(int i=1; i<=steps; i++){
+                auto t0 = std::chrono::steady_clock::now();
+                full.recompute(walk[i].first, walk[i].second);
+                auto t1 = std::chrono::steady_clock::now();
+                inc.setSource(walk[i].first, walk[i].second);
+                inc.update();
+                tFull += t1 - t0;
+                tStep += std::chrono::steady_clock::now() - t1;
             }
+            bool same = !memcmp(da.data(), db.data(), da.cellCount() * sizeof(uint16_t)) &&
+                        !memcmp(ha.data(), hb.data(), ha.cellCount());
+            char label[32];
+            snprintf(label, sizeof(label), "%dx%d", w, h);
+            printf("%-11s %-13s %12.1f %12.1f %7.2fx%s\n", label, names[k],
+                   tFull.count() / steps, tStep.count() / steps, tFull.count() / tStep.count(),
+                   same ? "" : "  MISMATCH");
         }
     }
-    if(d.upCount>0) {
-        d.base_map[d.up_yCoord][d.up_xCoord] = '<';
-    }
-    if(d.downCount>0) {
-        d.base_map[d.down_yCoord][d.down_xCoord] = '>';
+}
+
+// --bench hops: one intelligent-monster decision made the old way (scan the
+// 8 neighbour distances, as NPC::doTurn does) against one hop-map lookup, at
+// the same random open cells of the tunneling map, in ns per decision. Also
+// times a full hop rebuild, which every full Dijkstra pass now pays for.
+static int benchHops() {
+    static const int sizes[][2] = { {80, 21}, {256, 256}, {1024, 1024} };
+    printf("%-11s %10s %10s %8s %11s\n", "size", "scan ns", "hop ns", "speedup", "rebuild us");
+    int bad = 0;
+    for(auto &sz : sizes) {
+        int w = sz[0], h = sz[1];
+        Dungeon bench(w, h);
+        bench.reseed(327);
+        makeBenchGrid(bench);
+        std::vector<int> cells;
+        for(int y=0; y<h; y++){
+            for(int x=0; x<w; x++){
+                if(bench.hardness[y][x] == 0) cells.push_back(bench.hardness.index(x, y));
+            }
+        }
+        int sx = cells[0] % bench.hardness.stride() - 1;
+        int sy = cells[0] / bench.hardness.stride() - 1;
+        bench.recomputeDistanceMaps(sx, sy);
+        std::vector<int> probes(4096);
+        for(int &p : probes) p = cells[bench.rng.below((int)cells.size())];
+
+        const Grid<uint16_t> &dm = bench.disTunneling;
+        const Grid<uint8_t> &hm = bench.hopTunneling;
+        int st = dm.stride();
+        const int offs[8] = { -st-1, -st, -st+1, -1, 1, st-1, st, st+1 };
+        const int rounds = 1000;
+        long sumScan = 0, sumHop = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        for(int r=0; r<rounds; r++){
+            for(int here : probes) {
+                int bestIdx = here;
+                int bestDist = DIST_INF;
+                for(int i=0; i<8; i++){
+                    int dval = dm.at(here + offs[i]);
+                    if(dval < bestDist) {
+                        bestDist = dval;
+                        bestIdx = here + offs[i];
+                    }
+                }
+                sumScan += (bestIdx % st - 1) + (bestIdx / st - 1);
+            }
+        }
+        std::chrono::duration<double, std::nano> tScan = std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        for(int r=0; r<rounds; r++){
+            for(int here : probes) {
+                uint8_t hop = hm.at(here);
+                sumHop += (here % st - 1 + HOP_DX[hop]) + (here / st - 1 + HOP_DY[hop]);
+            }
+        }
+        std::chrono::duration<double, std::nano> tHop = std::chrono::steady_clock::now() - start;
+
+        int reps = std::max(3, 2000000 / (w*h));
+        start = std::chrono::steady_clock::now();
+        for(int i=0; i<reps; i++){
+            bench.tunnelPaths.rebuildHops();
+        }
+        std::chrono::duration<double, std::micro> tBuild = std::chrono::steady_clock::now() - start;
+
+        double n = (double)rounds * probes.size();
+        char label[32];
+        snprintf(label, sizeof(label), "%dx%d", w, h);
+        printf("%-11s %10.2f %10.2f %7.2fx %11.1f%s\n", label, tScan.count() / n,
+               tHop.count() / n, tScan.count() / tHop.count(), tBuild.count() / reps,
+               sumScan != sumHop ? "  MISMATCH" : "");
+        if(sumScan != sumHop) bad++;
     }
+    return bad ? 1 : 0;
+}
 
-    uint16_t monster_count;
-    size_t ret = fread(&monster_count, sizeof(monster_count),1,f);
-    if(ret == 1){
-        monster_count = be16toh(monster_count);
-    } else {
-        monster_count = 0;
+// --bench ai: monster turns through NPC::doTurn and through the per-btype
+// kernels, from the same seed. Each case first plays whole greedy games both
+// ways, then times rounds of monster turns alone (the PC standing still, maps
+// refreshed between rounds outside the timer). Both ways must end in the same
+// state.
+static int benchAI() {
+    struct Case { int w, h, nummon, floors; };
+    static const Case cases[] = {
+        { 80, 21, 10, 500 }, { 80, 21, 200, 100 }, { 256, 256, 2000, 5 },
+        { 512, 512, 10000, 2 }
+    };
+    printf("%-11s %7s %13s %13s %8s\n", "size", "nummon", "doTurn t/s", "kernel t/s", "speedup");
+    int bad = 0;
+    for(const Case &c : cases) {
+        double rate[2];
+        uint64_t hash[2];
+        for(int k=0; k<2; k++){
+            Dungeon d(c.w, c.h);
+            d.reseed(327);
+            d.global_num_monsters = c.nummon;
+            d.referenceAI = (k == 0);
+            d.newLevel(c.nummon);
+            GreedyStairsController ctl(328);
+            playHeadless(d, ctl, c.floors, -1);
+            uint64_t played = d.stateHash();
+
+            d.newLevel(c.nummon);
+            int rounds = std::max(10, 2000000 / c.nummon);
+            std::chrono::duration<double> secs(0);
+            for(int r=0; r<rounds; r++){
+                d.updateDistanceMaps(d.pc.x, d.pc.y);
+                auto start = std::chrono::steady_clock::now();
+                for(NPC &m : d.npcs) {
+                    d.npcTurn(m);
+                }
+                secs += std::chrono::steady_clock::now() - start;
+            }
+            rate[k] = (double)rounds * c.nummon / secs.count();
+            hash[k] = played ^ d.stateHash();
+        }
+        char label[32];
+        snprintf(label, sizeof(label), "%dx%d", c.w, c.h);
+        printf("%-11s %7d %13.0f %13.0f %7.2fx%s\n", label, c.nummon, rate[0], rate[1],
+               rate[1] / rate[0], hash[0] != hash[1] ? "  MISMATCH" : "");
+        if(hash[0] != hash[1]) bad++;
     }
+    return bad ? 1 : 0;
+}
 
-    for(auto c : d.characters) {
-        delete c;
+// A kill: the wheel drops the dead character's turn at once, while the heap
+// can only skip it when it comes up, as gameLoop used to.
+static void cancelTurn(EventQueue &, CharHandle) {}
+static void cancelTurn(TimingWheel &q, CharHandle who) { q.cancel(who); }
+
+// Takes ops turns the way gameLoop does, popping and re-pushing, and returns
+// the sum of their times (which the tie order cannot change). With massKill,
+// nine characters in ten die half way through, between two turn times.
+template <typename Q>
+static long long runSchedule(Q &q, const std::vector<int> &speeds, long ops, bool massKill,
+                             double &ns) {
+    std::vector<char> dead(speeds.size(), 0);
+    for(size_t i=0; i<speeds.size(); i++){
+        q.push(Event{ 0, (CharHandle)i });
     }
-    d.characters.clear();
-    for(int i=0; i<(int)monster_count; i++){
-        uint8_t mx,my,mspeed,mhp,mbtype;
-        fread(&mx,1,1,f);
-        fread(&my,1,1,f);
-        fread(&mspeed,1,1,f);
-        fread(&mhp,1,1,f);
-        fread(&mbtype,1,1,f);
-        NPC *mm = new NPC(mbtype, mx, my, mspeed, mhp);
-        d.characters.push_back(mm);
+    long long sum = 0;
+    int last = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(long i=0; i<ops; ){
+        Event e = q.pop();
+        if(massKill && i >= ops / 2 && e.time > last) {
+            for(size_t h=0; h<speeds.size(); h++){
+                if(h % 10 == 0) continue;
+                dead[h] = 1;
+                cancelTurn(q, (CharHandle)h);
+            }
+            massKill = false;
+        }
+        if(dead[e.who]) continue;
+        if(e.time < last) return -1;
+        last = e.time;
+        sum += e.time;
+        q.push(Event{ e.time + 1000 / speeds[e.who], e.who });
+        i++;
     }
+    std::chrono::duration<double, std::nano> t = std::chrono::steady_clock::now() - start;
+    ns = t.count() / ops;
+    return sum;
+}
 
-    fclose(f);
+// --bench sched: the EventQueue heap against the timing wheel with 1k to
+// 1M characters of speed 5-20 scheduled, in ns per turn, both with everyone
+// alive and with 90% killed half way through the run.
+static int benchSched() {
+    static const int counts[] = { 1000, 10000, 100000, 1000000 };
+    printf("%-9s %10s %10s %8s %12s %12s %8s\n", "chars", "heap ns", "wheel ns", "speedup",
+           "kill heap", "kill wheel", "speedup");
+    int bad = 0;
+    for(int n : counts) {
+        Rng rng(327);
+        std::vector<int> speeds(n);
+        for(int &sp : speeds) sp = 5 + rng.below(16);
+        long ops = std::max(2000000L, 4L * n);
+        double t[2][2];
+        long long sum[2][2];
+        for(int kill=0; kill<2; kill++){
+            EventQueue heap;
+            sum[kill][0] = runSchedule(heap, speeds, ops, kill != 0, t[kill][0]);
+            std::unique_ptr<TimingWheel> wheel(new TimingWheel);
+            sum[kill][1] = runSchedule(*wheel, speeds, ops, kill != 0, t[kill][1]);
+        }
+        bool ok = sum[0][1] >= 0 && sum[0][1] == sum[0][0] &&
+                  sum[1][1] >= 0 && sum[1][1] == sum[1][0];
+        printf("%-9d %10.1f %10.1f %7.2fx %12.1f %12.1f %7.2fx%s\n", n, t[0][0], t[0][1],
+               t[0][0] / t[0][1], t[1][0], t[1][1], t[1][0] / t[1][1], ok ? "" : "  MISMATCH");
+        if(!ok) bad++;
+    }
+    return bad ? 1 : 0;
 }
+
 int main(int argc, char *argv[]) {
-    srand(time(NULL));
-    Dungeon dungeon;
+    for(int i=1; i+1<argc; i++){
+        if(!strcmp(argv[i], "--bench")) {
+            if(!strcmp(argv[i+1], "paths")) {
+                benchPaths();
+                benchSourceSteps();
+                return 0;
+            }
+            if(!strcmp(argv[i+1], "ai")) {
+                return benchAI();
+            }
+            if(!strcmp(argv[i+1], "hops")) {
+                return benchHops();
+            }
+            if(!strcmp(argv[i+1], "sched")) {
+                return benchSched();
+            }
+            std::cerr << "Unknown benchmark " << argv[i+1] << std::endl;
+            return 1;
+        }
+    }
+    uint64_t seed = (uint64_t)std::chrono::system_clock::now().time_since_epoch().count();
+    const char *record_path = nullptr;
+    const char *replay_path = nullptr;
     bool do_load = false;
     bool do_save = false;
+    SaveFormat save_format = SAVE_CLASSIC;
+    bool parallel_paths = false;
+    bool prefetch = true;
+    long floor_cache_mb = 64;
+#ifdef RLG_HEADLESS
+    bool headless = true;
+#else
+    bool headless = false;
+#endif
+    std::string controller_name = "greedy";
+    std::string script;
+    int floors = 100;
+    long max_turns = -1;
     int local_num_mon = DEFAULT_NUMMON;
+    int num_rooms = 0;
+    int lod = 0;
+    long batch = 0;
+    int threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    std::string out_dir;
+    int map_width = DEFAULT_WIDTH;
+    int map_height = DEFAULT_HEIGHT;
     for(int i=1; i<argc; i++){
         if(!strcmp(argv[i], "--load")) {
             do_load = true;
         } else if(!strcmp(argv[i], "--save")) {
             do_save = true;
+        } else if(!strcmp(argv[i], "--compact")) {
+            save_format = SAVE_COMPACT;
+        } else if(!strcmp(argv[i], "--delta")) {
+            save_format = SAVE_DELTA;
         } else if(!strcmp(argv[i],"--nummon") && i+1<argc) {
             local_num_mon = atoi(argv[++i]);
+        } else if(!strcmp(argv[i], "--rooms") && i+1<argc) {
+            num_rooms = atoi(argv[++i]);
+        } else if(!strcmp(argv[i], "--lod") && i+1<argc) {
+            lod = atoi(argv[++i]);
+        } else if(!strcmp(argv[i], "--batch") && i+1<argc) {
+            batch = atol(argv[++i]);
+        } else if(!strcmp(argv[i], "--threads") && i+1<argc) {
+            threads = std::max(1, atoi(argv[++i]));
+        } else if(!strcmp(argv[i], "--out") && i+1<argc) {
+            out_dir = argv[++i];
+        } else if(!strcmp(argv[i], "--parallel-paths")) {
+            parallel_paths = true;
+        } else if(!strcmp(argv[i], "--floor-cache") && i+1<argc) {
+            floor_cache_mb = std::max(0L, atol(argv[++i]));
+        } else if(!strcmp(argv[i], "--no-prefetch")) {
+            prefetch = false;
+        } else if(!strcmp(argv[i], "--width") && i+1<argc) {
+            map_width = atoi(argv[++i]);
+        } else if(!strcmp(argv[i], "--height") && i+1<argc) {
+            map_height = atoi(argv[++i]);
+        } else if(!strcmp(argv[i], "--headless")) {
+            headless = true;
+        } else if(!strcmp(argv[i], "--controller") && i+1<argc) {
+            controller_name = argv[++i];
+        } else if(!strcmp(argv[i], "--script") && i+1<argc) {
+            script = argv[++i];
+            controller_name = "script";
+        } else if(!strcmp(argv[i], "--floors") && i+1<argc) {
+            floors = atoi(argv[++i]);
+        } else if(!strcmp(argv[i], "--turns") && i+1<argc) {
+            max_turns = atol(argv[++i]);
+        } else if(!strcmp(argv[i], "--seed") && i+1<argc) {
+            seed = strtoull(argv[++i], nullptr, 0);
+        } else if(!strcmp(argv[i], "--record") && i+1<argc) {
+            record_path = argv[++i];
+        } else if(!strcmp(argv[i], "--replay") && i+1<argc) {
+            replay_path = argv[++i];
+        }
+    }
+    // A replay takes everything that shapes the game from the log, and
+    // always runs headless.
+    SessionLog replay;
+    if(replay_path) {
+        if(!loadSession(replay, replay_path)) {
+            return 1;
+        }
+        seed = replay.seed;
+        map_width = replay.width;
+        map_height = replay.height;
+        local_num_mon = (int)replay.nummon;
+        num_rooms = (int)replay.rooms;
+        lod = (int)replay.lod;
+        do_load = replay.flags & SESSION_LOADED;
+        do_save = false;
+        floors = replay.floors;
+        max_turns = replay.turns;
+        headless = true;
+    }
+    if(map_width < MIN_WIDTH || map_width > MAX_DIMENSION ||
+       map_height < MIN_HEIGHT || map_height > MAX_DIMENSION) {
+        std::cerr << "Dungeon size must be between " << MIN_WIDTH << "x" << MIN_HEIGHT
+                  << " and " << MAX_DIMENSION << "x" << MAX_DIMENSION << std::endl;
+        return 1;
+    }
+    if(num_rooms < 0) {
+        std::cerr << "--rooms must be 0 (scale with the map) or more" << std::endl;
+        return 1;
+    }
+    if(lod < 0) {
+        std::cerr << "--lod must be 0 (off) or more" << std::endl;
+        return 1;
+    }
+    if(batch > 0) {
+        if(out_dir.empty()) {
+            checkDir();
+            out_dir = std::string(getenv("HOME")) + DUNGEON_DIR + "batch";
         }
+        return runBatch(seed, batch, threads, map_width, map_height, local_num_mon, num_rooms,
+                        save_format, out_dir);
+    }
+    Dungeon dungeon(map_width, map_height);
+    dungeon.reseed(seed);
+    if(parallel_paths) {
+        dungeon.enableParallelPaths();
     }
     dungeon.global_num_monsters = local_num_mon;
+    dungeon.roomsWanted = num_rooms;
+    dungeon.lodDistance = lod;
 
     checkDir();
     char path[1024];
     getPath(path, sizeof(path));
 
     if(do_load){
-        load_dungeon(dungeon, path);
-    } else {
-        // generate random dungeon
-        for(int y=0; y<HEIGHT; y++){
-            for(int x=0; x<WIDTH; x++){
-                if(x==0 || x==WIDTH-1 || y==0 || y==HEIGHT-1){
-                    dungeon.hardness[y][x] = 255;
-                    dungeon.base_map[y][x]  = ' ';
-                } else {
-                    dungeon.hardness[y][x] = (rand()%254)+1;
-                    dungeon.base_map[y][x]  = ' ';
-                }
-            }
+        if(!load_dungeon(dungeon, path)) {
+            return 1;
         }
-        generateRooms(dungeon);
-        connectRoomsViaCorridor(dungeon);
-        placeStairs(dungeon);
-        if(dungeon.room_count > 0) {
-            dungeon.pc_x = dungeon.rooms[0].x;
-            dungeon.pc_y = dungeon.rooms[0].y;
+        dungeon.createPC(dungeon.pc_x, dungeon.pc_y);
+    } else {
+        // generate random dungeon; play goes on with the same stream
+        dungeon.generateFromSeed(seed, local_num_mon);
+    }
+    if(do_save){
+        save_dungeon(dungeon, path, save_format);
+    }
+    std::string spill_dir = std::string(getenv("HOME")) + DUNGEON_DIR;
+    spill_dir.pop_back();
+    dungeon.enableFloorStack((size_t)floor_cache_mb << 20, spill_dir);
+    if(prefetch) {
+        dungeon.enablePrefetch();
+    }
+    SessionLog record;
+    record.seed = seed;
+    record.width = map_width;
+    record.height = map_height;
+    record.nummon = (uint32_t)local_num_mon;
+    record.rooms = (uint32_t)num_rooms;
+    record.lod = (uint32_t)lod;
+    record.flags = (do_load ? SESSION_LOADED : 0) | (headless ? SESSION_HEADLESS : 0);
+    record.floors = floors;
+    record.turns = max_turns;
+    record.finalHash = 0;
+
+    if(replay_path) {
+        ScriptedController keys(replay.keys);
+        if(replay.flags & SESSION_HEADLESS) {
+            runHeadless(dungeon, keys, floors, max_turns);
         } else {
-            dungeon.pc_x = 1;
-            dungeon.pc_y = 1;
+            dungeon.controller = &keys;
+            auto start = std::chrono::steady_clock::now();
+            playFloors(dungeon);
+            std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+            printf("seed %llu  pc turns %ld  monster turns %ld\n%.3f s\n",
+                   (unsigned long long)seed, dungeon.pcTurns, dungeon.npcTurns, secs.count());
         }
-    }
-    memcpy(dungeon.dungeon, dungeon.base_map, sizeof(dungeon.dungeon));
-    dungeon.createPC(dungeon.pc_x, dungeon.pc_y);
-    if(!do_load){
-        for(int i=0; i<local_num_mon; i++){
-            dungeon.createMonster();
+        if(dungeon.stateHash() != replay.finalHash) {
+            std::cerr << "Replay diverged from " << replay_path << std::endl;
+            return 1;
         }
+        printf("replay matches %s (%zu keys)\n", replay_path, replay.keys.size());
+        return 0;
     }
-    if(do_save){
-        save_dungeon(dungeon, path);
-    }
-    initscr();
-    cbreak();
-    noecho();
-    keypad(stdscr, TRUE);
-    curs_set(0);
-    start_color();
-    while(dungeon.pc_is_alive) {
-        dungeon.gameLoop();
-        if(!dungeon.pc_is_alive) {
-            break;
+
+    if(headless) {
+        std::unique_ptr<PCController> ctl;
+        if(controller_name == "greedy") {
+            ctl.reset(new GreedyStairsController(seed + 1));
+        } else if(controller_name == "random") {
+            ctl.reset(new RandomController(seed + 1));
+        } else if(controller_name == "script") {
+            ctl.reset(new ScriptedController(script));
+        } else {
+            std::cerr << "Unknown controller " << controller_name
+                      << " (greedy, random or script)" << std::endl;
+            return 1;
         }
-        if(dungeon.changedFloor) {
-            dungeon.newLevel(dungeon.global_num_monsters);
+        RecordingController recorder(*ctl, record.keys);
+        int rc = runHeadless(dungeon, record_path ? recorder : *ctl, floors, max_turns);
+        if(record_path) {
+            record.finalHash = dungeon.stateHash();
+            saveSession(record, record_path);
+        }
+        return rc;
+    }
+#ifndef RLG_HEADLESS
+    {
+        CursesDisplay screen;
+        CursesController keyboard;
+        RecordingController recorder(keyboard, record.keys);
+        dungeon.display = &screen;
+        if(record_path) {
+            dungeon.controller = &recorder;
         } else {
-            break;
+            dungeon.controller = &keyboard;
         }
+        playFloors(dungeon);
+        record.finalHash = dungeon.stateHash();
+        screen.showEnd(dungeon);
     }
-    dungeon.rebuildDisplay();
-    clear();
-    if(!dungeon.pc_is_alive) {
-        printw("You lose! The PC has been killed.\n");
-    } else {
+    if(record_path) {
+        saveSession(record, record_path);
     }
-    printw("Press any key to quit...");
-    refresh();
-    getch();
-    endwin();
+#endif
 
     return 0;
 }